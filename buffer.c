@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Changes waiting to be written. Operations store and delete records, data
+// blocks included, in this buffer only, and the flusher (flush.c) writes
+// everything buffered so far in one go, so an operation costs no database
+// work or commit of its own. Writers wait once more than dirty_limit bytes
+// are buffered, until a flush has caught up.
+//
+// A flush takes the table of buffered records over as a whole and new
+// changes go into the other table meanwhile. Lookups try the table being
+// filled, then the one being written and only then the databases. The
+// table being written only changes in the flusher, which frees it once it
+// has been committed.
+typedef struct buffered_record {
+	int set; /* BUFFER_METADATA or BUFFER_DATA */
+	int deleted;
+	int key_size;
+	size_t size;
+
+	struct buffered_record *next;
+
+	uint8_t bytes[]; /* the key followed by the record */
+
+} buffered_record;
+
+typedef struct record_table {
+	buffered_record *slots[BUFFER_HASH_SIZE];
+	size_t bytes;
+
+} record_table;
+
+static record_table tables[2];
+static record_table *filling = &tables[0];
+static record_table *flushing; /* NULL while no flush is writing */
+
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_flushed = PTHREAD_COND_INITIALIZER;
+
+
+static buffered_record **key_slot(record_table *table, int set, const void *key, int key_size) {
+	return &table->slots[fnv1a(FNV1A_SEED ^ set, key, key_size) % BUFFER_HASH_SIZE];
+}
+
+static buffered_record **find_link(record_table *table, int set, const void *key, int key_size) {
+	buffered_record **link = key_slot(table, set, key, key_size);
+
+	while (*link != NULL && ((*link)->set != set || (*link)->key_size != key_size || memcmp((*link)->bytes, key, key_size) != 0))
+		link = &(*link)->next;
+
+	return link;
+}
+
+// Latest buffered version of a record, or NULL if it is not buffered
+static buffered_record *find_record(int set, const void *key, int key_size) {
+	buffered_record *record = *find_link(filling, set, key, key_size);
+
+	if (record == NULL && flushing != NULL)
+		record = *find_link(flushing, set, key, key_size);
+
+	return record;
+}
+
+// Fetching a buffered record into data, which holds *size bytes, and
+// setting *size to its size. Returns 1 if it was found, -ENOENT if it was
+// deleted and 0 if it is not buffered.
+int buffer_fetch(int set, const void *key, int key_size, void *data, size_t *size) {
+	pthread_mutex_lock(&buffer_lock);
+
+	buffered_record *record = find_record(set, key, key_size);
+	int rc = 0;
+
+	if (record != NULL && record->deleted)
+		rc = -ENOENT;
+	else if (record != NULL) {
+		memcpy(data, record->bytes + key_size, record->size < *size ? record->size : *size);
+		*size = record->size;
+		rc = 1;
+	}
+
+	pthread_mutex_unlock(&buffer_lock);
+
+	return rc;
+}
+
+// Like buffer_fetch, into a buffer the caller frees
+int buffer_fetch_alloc(int set, const void *key, int key_size, void **data, size_t *size) {
+	pthread_mutex_lock(&buffer_lock);
+
+	buffered_record *record = find_record(set, key, key_size);
+	int rc = 0;
+
+	if (record != NULL && record->deleted)
+		rc = -ENOENT;
+	else if (record != NULL) {
+		*data = malloc(record->size);
+		memcpy(*data, record->bytes + key_size, record->size);
+		*size = record->size;
+		rc = 1;
+	}
+
+	pthread_mutex_unlock(&buffer_lock);
+
+	return rc;
+}
+
+// Replace whatever is buffered for a key in the table being filled
+static void buffer_put(int set, const void *key, int key_size, const void *data, size_t size, int deleted) {
+	buffered_record *record = malloc(sizeof(buffered_record) + key_size + size);
+
+	record->set = set;
+	record->deleted = deleted;
+	record->key_size = key_size;
+	record->size = size;
+	memcpy(record->bytes, key, key_size);
+
+	if (size > 0)
+		memcpy(record->bytes + key_size, data, size);
+
+	pthread_mutex_lock(&buffer_lock);
+
+	buffered_record **link = find_link(filling, set, key, key_size);
+	buffered_record *old = *link;
+
+	if (old != NULL) {
+		record->next = old->next;
+		filling->bytes -= sizeof(buffered_record) + old->key_size + old->size;
+		free(old);
+	}
+	else
+		record->next = NULL;
+
+	*link = record;
+	filling->bytes += sizeof(buffered_record) + key_size + size;
+
+	int over_limit = filling->bytes > dirty_limit;
+
+	pthread_mutex_unlock(&buffer_lock);
+
+	if (over_limit)
+		wake_flusher();
+}
+
+// Storing a record. The databases are only written by the flusher.
+void buffer_store(int set, const void *key, int key_size, const void *data, size_t size) {
+	buffer_put(set, key, key_size, data, size, 0);
+}
+
+// Removing a record, buffered or written
+void buffer_delete(int set, const void *key, int key_size) {
+	buffer_put(set, key, key_size, NULL, 0, 1);
+}
+
+// Hand every buffered change over to a flush, which writes them with
+// buffer_write. Returns 0 if there is nothing to write.
+int buffer_take() {
+	pthread_mutex_lock(&buffer_lock);
+
+	int taken = filling->bytes > 0;
+
+	if (taken) {
+		flushing = filling;
+		filling = filling == &tables[0] ? &tables[1] : &tables[0];
+	}
+
+	pthread_mutex_unlock(&buffer_lock);
+
+	return taken;
+}
+
+// Write the data blocks, stored or deleted as asked, and return how many
+static size_t write_blocks(int deleted) {
+	size_t count = 0;
+
+	for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+		for (buffered_record *record = flushing->slots[i]; record != NULL; record = record->next) {
+			if (record->set != BUFFER_DATA || record->deleted != deleted)
+				continue;
+
+			if (deleted)
+				erase_data_record(record->bytes, record->key_size);
+			else
+				save_data_record(record->bytes, record->key_size, record->bytes + record->key_size, record->size);
+
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// Write the metadata records as one journal, which the store applies as a
+// whole (fs.c), and return how many there are
+static size_t write_records() {
+	size_t count = 0;
+	size_t size = 0;
+
+	for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+		for (buffered_record *record = flushing->slots[i]; record != NULL; record = record->next) {
+			if (record->set == BUFFER_METADATA)
+				size += sizeof(journal_entry) + record->key_size + record->size;
+		}
+	}
+
+	if (size == 0)
+		return 0;
+
+	uint8_t *journal = malloc(size);
+	uint8_t *next = journal;
+
+	for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+		for (buffered_record *record = flushing->slots[i]; record != NULL; record = record->next) {
+			if (record->set != BUFFER_METADATA)
+				continue;
+
+			journal_entry entry = { record->deleted, record->key_size, record->size };
+
+			memcpy(next, &entry, sizeof(journal_entry));
+			memcpy(next + sizeof(journal_entry), record->bytes, record->key_size + record->size);
+			next += sizeof(journal_entry) + record->key_size + record->size;
+
+			count++;
+		}
+	}
+
+	write_metadata(journal, size);
+
+	free(journal);
+
+	return count;
+}
+
+// Write the changes taken over by buffer_take to the databases. Data blocks
+// are committed before the metadata pointing at them, and deleted only
+// after the metadata that let go of them, so a crash in between at worst
+// leaves blocks nothing points at.
+void buffer_write() {
+	size_t count = write_blocks(0);
+
+	commit_data_shards();
+
+	count += write_records();
+
+	size_t erased = write_blocks(1);
+
+	commit_data_shards();
+
+	write_log("Wrote back %zu records\n", count + erased);
+
+	pthread_mutex_lock(&buffer_lock);
+
+	for (int i = 0; i < BUFFER_HASH_SIZE; i++) {
+		while (flushing->slots[i] != NULL) {
+			buffered_record *record = flushing->slots[i];
+
+			flushing->slots[i] = record->next;
+			free(record);
+		}
+	}
+
+	flushing->bytes = 0;
+	flushing = NULL;
+
+	pthread_cond_broadcast(&buffer_flushed);
+
+	pthread_mutex_unlock(&buffer_lock);
+}
+
+// Wait while too much is buffered. Never called within a transaction, which
+// would hold the flusher back.
+void throttle_buffer() {
+	pthread_mutex_lock(&buffer_lock);
+
+	while (filling->bytes > dirty_limit) {
+		wake_flusher();
+		pthread_cond_wait(&buffer_flushed, &buffer_lock);
+	}
+
+	pthread_mutex_unlock(&buffer_lock);
+}
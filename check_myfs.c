@@ -0,0 +1,451 @@
+// Checks of the file system driven through its low-level operations, without
+// mounting anything. The operations are called the way the kernel would,
+// with the replies caught by the fuse_reply_* functions below in place of
+// those of libfuse. Every check runs in a process and a store of its own,
+// in a directory named after it, so a crash is simply a process that exits
+// without unmounting. Run it from an empty directory, 'make check' does.
+#define main myfs_main
+#include "myfs.c"
+#undef main
+
+#include <sys/wait.h>
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+		exit(1); \
+	} \
+} while (0)
+
+// What a request was answered with
+struct fuse_req {
+	int err;
+	struct fuse_entry_param entry;
+	struct stat attr;
+	char *buf;
+	size_t size;
+};
+
+static struct fuse_ctx request_context;
+
+int fuse_reply_err(fuse_req_t req, int err) {
+	req->err = err;
+	return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) {
+	req->err = 0;
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+	req->entry = *e;
+	return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi) {
+	req->entry = *e;
+	return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout) {
+	req->attr = *attr;
+	return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+	return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+	req->size = count;
+	return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) {
+	req->buf = malloc(size + 1);
+	memcpy(req->buf, buf, size);
+	req->size = size;
+	return 0;
+}
+
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req) {
+	return &request_context;
+}
+
+// Mounting and unmounting, as main and the FUSE session would
+static void mount_fs() {
+	struct fuse_conn_info conn;
+
+	memset(&conn, 0, sizeof(conn));
+
+	init_fs();
+	myfs_oper.init(NULL, &conn);
+}
+
+static void unmount_fs() {
+	myfs_oper.destroy(NULL);
+	shutdown_fs();
+}
+
+// The operations, each answering a request of its own
+static fuse_ino_t do_lookup(fuse_ino_t parent, const char *name) {
+	struct fuse_req req = { 0 };
+
+	myfs_oper.lookup(&req, parent, name);
+	CHECK(req.err == 0);
+
+	return req.entry.ino;
+}
+
+static void do_forget(fuse_ino_t ino) {
+	struct fuse_req req = { 0 };
+
+	myfs_oper.forget(&req, ino, 1);
+}
+
+static fuse_ino_t do_create(fuse_ino_t parent, const char *name, struct fuse_file_info *fi) {
+	struct fuse_req req = { 0 };
+
+	memset(fi, 0, sizeof(struct fuse_file_info));
+	myfs_oper.create(&req, parent, name, S_IFREG | 0644, fi);
+	CHECK(req.err == 0 && req.entry.ino != 0);
+
+	return req.entry.ino;
+}
+
+static void do_open(fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct fuse_req req = { 0 };
+
+	memset(fi, 0, sizeof(struct fuse_file_info));
+	myfs_oper.open(&req, ino, fi);
+	CHECK(req.err == 0);
+}
+
+static void do_release(fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct fuse_req req = { 0 };
+
+	myfs_oper.release(&req, ino, fi);
+	CHECK(req.err == 0);
+}
+
+static void do_write(fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct fuse_req req = { 0 };
+
+	myfs_oper.write(&req, ino, buf, size, off, fi);
+	CHECK(req.err == 0 && req.size == size);
+}
+
+// Read into buf and return how many bytes there were
+static size_t do_read(fuse_ino_t ino, char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct fuse_req req = { 0 };
+
+	myfs_oper.read(&req, ino, size, off, fi);
+	CHECK(req.err == 0 && req.size <= size);
+
+	memcpy(buf, req.buf, req.size);
+	free(req.buf);
+
+	return req.size;
+}
+
+static void do_truncate(fuse_ino_t ino, off_t size) {
+	struct fuse_req req = { 0 };
+	struct stat attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.st_size = size;
+
+	myfs_oper.setattr(&req, ino, &attr, FUSE_SET_ATTR_SIZE, NULL);
+	CHECK(req.err == 0 && req.attr.st_size == size);
+}
+
+static void do_unlink(fuse_ino_t parent, const char *name) {
+	struct fuse_req req = { 0 };
+
+	myfs_oper.unlink(&req, parent, name);
+	CHECK(req.err == 0);
+}
+
+// Bytes a file written by fill_file holds at off
+static char pattern(off_t off) {
+	return (char) (off * 7 + off / 4093);
+}
+
+static void fill(char *buf, size_t size, off_t off) {
+	for (size_t i = 0; i < size; i++)
+		buf[i] = pattern(off + i);
+}
+
+// Create a file holding size bytes of the pattern and close it again
+static void fill_file(const char *name, size_t size) {
+	struct fuse_file_info fi;
+	char *buf = malloc(size);
+
+	fill(buf, size, 0);
+
+	fuse_ino_t ino = do_create(FUSE_ROOT_ID, name, &fi);
+
+	do_write(ino, buf, size, 0, &fi);
+	do_release(ino, &fi);
+	do_forget(ino);
+
+	free(buf);
+}
+
+// Check that a file holds the pattern up to keep and zeros up to size
+static void check_file(const char *name, size_t keep, size_t size) {
+	struct fuse_file_info fi;
+	char *buf = malloc(size + 1);
+
+	fuse_ino_t ino = do_lookup(FUSE_ROOT_ID, name);
+
+	CHECK(ino != 0);
+
+	do_open(ino, &fi);
+	CHECK(do_read(ino, buf, size + 1, 0, &fi) == size);
+	do_release(ino, &fi);
+	do_forget(ino);
+
+	for (size_t i = 0; i < size; i++)
+		CHECK(buf[i] == (i < keep ? pattern(i) : 0));
+
+	free(buf);
+}
+
+// Remove a file the kernel has forgotten
+static void remove_file(const char *name) {
+	do_unlink(FUSE_ROOT_ID, name);
+}
+
+static void check_space(uint64_t live, uint64_t dead) {
+	CHECK(super_block.live_bytes == live);
+	CHECK(super_block.dead_bytes == dead);
+}
+
+// Run step in a process of its own that exits without unmounting, leaving
+// the store as a crash would
+static void crash_after(void (*step)()) {
+	pid_t pid = fork();
+	int status;
+
+	CHECK(pid >= 0);
+
+	if (pid == 0) {
+		step();
+		fflush(stdout);
+		_exit(0);
+	}
+
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Cutting a file and growing it again reads back zeros in between, in
+// blocks and inline, before and after a remount
+static void check_truncate() {
+	size_t size = 3 * DEFAULT_BLOCK_SIZE + 100;
+
+	mount_fs();
+
+	fill_file("blocks", size);
+	fuse_ino_t ino = do_lookup(FUSE_ROOT_ID, "blocks");
+	do_truncate(ino, DEFAULT_BLOCK_SIZE + 10);
+	do_truncate(ino, size);
+	do_forget(ino);
+	check_file("blocks", DEFAULT_BLOCK_SIZE + 10, size);
+
+	fill_file("inline", 100);
+	ino = do_lookup(FUSE_ROOT_ID, "inline");
+	do_truncate(ino, 3);
+	do_truncate(ino, 50);
+	do_forget(ino);
+	check_file("inline", 3, 50);
+
+	unmount_fs();
+	mount_fs();
+
+	check_file("blocks", DEFAULT_BLOCK_SIZE + 10, size);
+	check_file("inline", 3, 50);
+
+	remove_file("blocks");
+	remove_file("inline");
+
+	unmount_fs();
+	check_space(0, 0);
+}
+
+// An unlinked file stays usable while it is open, and everything it ever
+// held is freed once the kernel forgets it, writes after the unlink too
+static void check_unlink_open() {
+	struct fuse_file_info fi;
+	char buf[4 * DEFAULT_BLOCK_SIZE];
+
+	mount_fs();
+
+	fill(buf, sizeof(buf), 0);
+
+	fuse_ino_t ino = do_create(FUSE_ROOT_ID, "open", &fi);
+
+	do_write(ino, buf, 2 * DEFAULT_BLOCK_SIZE, 0, &fi);
+	do_unlink(FUSE_ROOT_ID, "open");
+	do_write(ino, buf + 2 * DEFAULT_BLOCK_SIZE, 2 * DEFAULT_BLOCK_SIZE, 2 * DEFAULT_BLOCK_SIZE, &fi);
+
+	CHECK(do_read(ino, buf, sizeof(buf), 0, &fi) == sizeof(buf));
+
+	for (size_t i = 0; i < sizeof(buf); i++)
+		CHECK(buf[i] == pattern(i));
+
+	check_space(sizeof(buf), 0);
+
+	do_release(ino, &fi);
+	do_forget(ino);
+
+	unmount_fs();
+	check_space(0, 0);
+
+	mount_fs();
+	check_space(0, 0);
+	unmount_fs();
+}
+
+// Files written before a remount read back the same
+static void check_remount() {
+	mount_fs();
+
+	fill_file("big", 10 * DEFAULT_BLOCK_SIZE + 1);
+	fill_file("small", 20);
+
+	unmount_fs();
+	mount_fs();
+
+	check_file("big", 10 * DEFAULT_BLOCK_SIZE + 1, 10 * DEFAULT_BLOCK_SIZE + 1);
+	check_file("small", 20, 20);
+	check_space(11 * DEFAULT_BLOCK_SIZE, 0);
+
+	unmount_fs();
+}
+
+// A flush that stopped after committing its journal is completed by the
+// next mount
+static uint8_t journal_keys[2][KEY_SIZE] = { { 1 }, { 2 } };
+
+static void check_journal() {
+	// A store of several databases, which a flush writes through the journal
+	format_shard_count = 4;
+
+	mount_fs();
+	fill_file("before", 10);
+	unmount_fs();
+
+	uint8_t journal[2 * (sizeof(journal_entry) + KEY_SIZE + 3)];
+	uint8_t *next = journal;
+
+	for (int i = 0; i < 2; i++) {
+		journal_entry entry = { 0, KEY_SIZE, 3 };
+
+		memcpy(next, &entry, sizeof(journal_entry));
+		memcpy(next + sizeof(journal_entry), journal_keys[i], KEY_SIZE);
+		memcpy(next + sizeof(journal_entry) + KEY_SIZE, i == 0 ? "one" : "two", 3);
+		next += sizeof(journal_entry) + KEY_SIZE + 3;
+	}
+
+	unqlite *db;
+
+	CHECK(unqlite_open(&db, DATABASE_NAME, UNQLITE_OPEN_READWRITE) == UNQLITE_OK);
+	CHECK(unqlite_kv_store(db, JOURNAL_KEY, JOURNAL_KEY_SIZE, journal, sizeof(journal)) == UNQLITE_OK);
+	CHECK(unqlite_close(db) == UNQLITE_OK);
+
+	mount_fs();
+
+	char value[3];
+	unqlite_int64 size;
+
+	fetch_record(journal_keys[0], KEY_SIZE, value, sizeof(value));
+	CHECK(memcmp(value, "one", 3) == 0);
+	fetch_record(journal_keys[1], KEY_SIZE, value, sizeof(value));
+	CHECK(memcmp(value, "two", 3) == 0);
+	CHECK(unqlite_kv_fetch(pDb, JOURNAL_KEY, JOURNAL_KEY_SIZE, NULL, &size) == UNQLITE_NOTFOUND);
+
+	check_file("before", 10, 10);
+
+	unmount_fs();
+}
+
+// Space left to reclaim at a crash is reclaimed by the next mount
+static void leave_reclaim_work() {
+	struct fuse_file_info fi;
+
+	mount_fs();
+
+	fill_file("cut", 3 * DEFAULT_BLOCK_SIZE);
+	fill_file("unlinked", 3 * DEFAULT_BLOCK_SIZE);
+
+	// Still known to the kernel at the crash
+	fuse_ino_t ino = do_lookup(FUSE_ROOT_ID, "unlinked");
+
+	do_open(ino, &fi);
+	do_unlink(FUSE_ROOT_ID, "unlinked");
+
+	stop_reclaimer();
+
+	ino = do_lookup(FUSE_ROOT_ID, "cut");
+	do_truncate(ino, 10);
+	do_forget(ino);
+
+	flush_all();
+	check_space(4 * DEFAULT_BLOCK_SIZE, 2 * DEFAULT_BLOCK_SIZE);
+}
+
+static void check_reclaim_resume() {
+	crash_after(leave_reclaim_work);
+
+	mount_fs();
+	remove_file("cut");
+	unmount_fs();
+
+	check_space(0, 0);
+}
+
+static int failures;
+
+static void run(const char *name, void (*check)()) {
+	int status;
+
+	fflush(stdout);
+
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		mkdir(name, 0755);
+
+		if (chdir(name) != 0) {
+			perror(name);
+			exit(1);
+		}
+
+		// The file system prints its progress, only failures matter here
+		if (freopen("/dev/null", "w", stdout) == NULL)
+			exit(1);
+
+		init_log_file();
+		check();
+		exit(0);
+	}
+
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("FAIL %s\n", name);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	run("truncate", check_truncate);
+	run("unlink_open", check_unlink_open);
+	run("remount", check_remount);
+	run("journal", check_journal);
+	run("reclaim_resume", check_reclaim_resume);
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
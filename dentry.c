@@ -0,0 +1,88 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Recently resolved names, so looking one up again does not cost a bucket
+// fetch. A name that was not found is kept as a negative entry. Entries
+// are dropped when the name is created or removed.
+typedef struct dentry {
+	int valid;
+	int negative;
+	uuid_t parent; /* inode id of the directory holding the name */
+	char name[MAX_NAME_SIZE];
+	uuid_t id; /* inode the name resolves to */
+
+} dentry;
+
+static dentry dentry_cache[DENTRY_CACHE_SIZE];
+static pthread_mutex_t dentry_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// FNV-1a hash of the parent id followed by the name
+static dentry *cache_slot(const uuid_t parent, const char *name) {
+	uint32_t hash = fnv1a(fnv1a(FNV1A_SEED, parent, sizeof(uuid_t)), name, strlen(name));
+
+	return &dentry_cache[hash % DENTRY_CACHE_SIZE];
+}
+
+static int matches(const dentry *entry, const uuid_t parent, const char *name) {
+	return entry->valid && uuid_compare(entry->parent, parent) == 0 && strcmp(entry->name, name) == 0;
+}
+
+// Look name up in the directory parent. Returns 0 and the inode id if the
+// name is cached, -ENOENT if it is cached as missing and 1 if it is not
+// cached at all.
+int dentry_lookup(const uuid_t parent, const char *name, uuid_t id) {
+	int rc = 1;
+
+	pthread_mutex_lock(&dentry_cache_lock);
+
+	dentry *entry = cache_slot(parent, name);
+
+	if (matches(entry, parent, name)) {
+		if (entry->negative)
+			rc = -ENOENT;
+		else {
+			uuid_copy(id, entry->id);
+			rc = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&dentry_cache_lock);
+
+	return rc;
+}
+
+// Remember the inode name in the directory parent resolves to, NULL for
+// a name that does not exist
+void dentry_insert(const uuid_t parent, const char *name, const uuid_t id) {
+	if (strlen(name) >= MAX_NAME_SIZE)
+		return;
+
+	pthread_mutex_lock(&dentry_cache_lock);
+
+	dentry *entry = cache_slot(parent, name);
+
+	entry->valid = 1;
+	entry->negative = id == NULL;
+	uuid_copy(entry->parent, parent);
+	strcpy(entry->name, name);
+
+	if (id != NULL)
+		uuid_copy(entry->id, id);
+
+	pthread_mutex_unlock(&dentry_cache_lock);
+}
+
+// Forget name in the directory parent, after it was created or removed
+void dentry_invalidate(const uuid_t parent, const char *name) {
+	pthread_mutex_lock(&dentry_cache_lock);
+
+	dentry *entry = cache_slot(parent, name);
+
+	if (matches(entry, parent, name))
+		entry->valid = 0;
+
+	pthread_mutex_unlock(&dentry_cache_lock);
+}
@@ -0,0 +1,379 @@
+#include <dirent.h>
+#include <errno.h>
+
+#include "myfs.h"
+
+// Entries of a directory live in pages stored next to its dir_fcb. Pages
+// are added as the directory grows and are never given back, so freed
+// space is reused before a new page is made.
+//
+// A page is a chain of variable-length dir_entry records, as in ext2. The
+// rec_len of an entry reaches up to the next one, so the space freed by a
+// removed entry goes to the one before it, and a new entry is put into the
+// slack at the end of an entry that has enough. Entries never move, which
+// keeps their offsets valid for the name index. Only the used head of a
+// page is stored.
+//
+// Names are also indexed by their hash: the bucket record of a hash lists
+// the entries with that hash and where they are kept, so finding a name
+// costs one fetch however large the directory is.
+
+static void page_key(const uuid_t dir_id, uint32_t page, dir_key *key) {
+	memset(key, 0, sizeof(dir_key));
+	uuid_copy(key->dir, dir_id);
+	key->type = DIR_KEY_PAGE;
+	key->number = page;
+}
+
+static dir_entry *entry_at(dir_page *page, uint32_t offset) {
+	return (dir_entry *) (page->data + offset);
+}
+
+// Bytes an entry needs for itself, 0 for the empty head of a page
+static uint32_t entry_used(const dir_entry *entry) {
+	return entry->name_len == 0 ? 0 : DIR_ENTRY_LEN(entry->name_len);
+}
+
+static void empty_dir_page(dir_page *page) {
+	memset(page, 0, sizeof(dir_page));
+	entry_at(page, 0)->rec_len = DIR_PAGE_SIZE;
+}
+
+static void fetch_dir_page(const dir_fcb *dir, uint32_t page, dir_page *entries) {
+	dir_key key;
+	size_t size;
+
+	page_key(dir->id, page, &key);
+
+	uint8_t *stored = fetch_record_alloc(&key, DIR_KEY_SIZE, &size);
+
+	if (stored == NULL || size > DIR_PAGE_SIZE) {
+		write_log("myfs_database error - directory page missing or too long\n");
+		exit(-1);
+	}
+
+	memset(entries, 0, sizeof(dir_page));
+	memcpy(entries->data, stored, size);
+
+	free(stored);
+}
+
+static void store_dir_page(const dir_fcb *dir, uint32_t page, dir_page *entries) {
+	dir_key key;
+	uint32_t offset = 0;
+	dir_entry *entry = entry_at(entries, 0);
+
+	// The last entry reaches the end of the page, nothing after it is stored
+	while (offset + entry->rec_len < DIR_PAGE_SIZE) {
+		offset += entry->rec_len;
+		entry = entry_at(entries, offset);
+	}
+
+	uint32_t used = entry_used(entry);
+
+	page_key(dir->id, page, &key);
+	store_record(&key, DIR_KEY_SIZE, entries, offset + (used > 0 ? used : sizeof(dir_entry)));
+}
+
+// Put an entry into the page. Returns its offset, or -1 if it does not fit.
+static int page_insert(dir_page *page, const char *name, uuid_t id, uint8_t type) {
+	uint32_t name_len = strlen(name);
+	uint32_t needed = DIR_ENTRY_LEN(name_len);
+	uint32_t offset = 0;
+
+	while (offset < DIR_PAGE_SIZE) {
+		dir_entry *entry = entry_at(page, offset);
+		uint32_t used = entry_used(entry);
+
+		if (entry->rec_len - used >= needed) {
+			dir_entry *added = entry_at(page, offset + used);
+
+			// An empty head is taken over, otherwise the slack is split off
+			if (used > 0) {
+				added->rec_len = entry->rec_len - used;
+				entry->rec_len = used;
+			}
+
+			uuid_copy(added->id, id);
+			added->name_len = name_len;
+			added->type = type;
+			memcpy(added->name, name, name_len);
+
+			return offset + used;
+		}
+
+		offset += entry->rec_len;
+	}
+
+	return -1;
+}
+
+// Drop the entry at offset, handing its space to the entry before it
+static void page_remove(dir_page *page, uint32_t offset) {
+	dir_entry *entry = entry_at(page, offset);
+
+	if (offset == 0) {
+		uint16_t rec_len = entry->rec_len;
+
+		memset(entry, 0, DIR_ENTRY_LEN(entry->name_len));
+		entry->rec_len = rec_len;
+		return;
+	}
+
+	uint32_t previous = 0;
+
+	while (previous + entry_at(page, previous)->rec_len < offset)
+		previous += entry_at(page, previous)->rec_len;
+
+	entry_at(page, previous)->rec_len += entry->rec_len;
+}
+
+// FNV-1a hash of a name
+static uint32_t name_hash(const char *name) {
+	return fnv1a(FNV1A_SEED, name, strlen(name));
+}
+
+static void bucket_key(const uuid_t dir_id, const char *name, dir_key *key) {
+	memset(key, 0, sizeof(dir_key));
+	uuid_copy(key->dir, dir_id);
+	key->type = DIR_KEY_HASH;
+	key->number = name_hash(name);
+}
+
+// Offset of the entry called name within a bucket, or -1
+static int find_in_bucket(const uint8_t *bucket, size_t size, const char *name, dir_hash_entry *found) {
+	size_t name_len = strlen(name);
+	size_t offset = 0;
+
+	while (offset < size) {
+		memcpy(found, bucket + offset, sizeof(dir_hash_entry));
+
+		if (found->name_len == name_len && memcmp(bucket + offset + sizeof(dir_hash_entry), name, name_len) == 0)
+			return offset;
+
+		offset += sizeof(dir_hash_entry) + found->name_len;
+	}
+
+	return -1;
+}
+
+// Record in its bucket, as fetched by the caller, that the entry called
+// name is kept in the given page at offset. Frees the bucket.
+static void index_entry(const dir_key *key, uint8_t *bucket, size_t size, const char *name, uuid_t id, uint32_t page, uint32_t offset) {
+	dir_hash_entry entry;
+
+	memset(&entry, 0, sizeof(dir_hash_entry));
+	uuid_copy(entry.id, id);
+	entry.page = page;
+	entry.offset = offset;
+	entry.name_len = strlen(name);
+
+	bucket = realloc(bucket, size + sizeof(dir_hash_entry) + entry.name_len);
+	memcpy(bucket + size, &entry, sizeof(dir_hash_entry));
+	memcpy(bucket + size + sizeof(dir_hash_entry), name, entry.name_len);
+
+	store_record(key, DIR_KEY_SIZE, bucket, size + sizeof(dir_hash_entry) + entry.name_len);
+
+	free(bucket);
+}
+
+// Store the fcb of a new, empty directory
+void dir_init(uuid_t data_id) {
+	dir_fcb dir;
+
+	memset(&dir, 0, sizeof(dir_fcb));
+	uuid_copy(dir.id, data_id);
+
+	store_data(dir.id, &dir, sizeof(dir_fcb));
+}
+
+// Find the entry called name. Returns 0 and its inode id, or -ENOENT.
+int dir_lookup(uuid_t dir_id, const char *name, uuid_t id) {
+	dir_key key;
+	dir_hash_entry entry;
+	size_t size;
+
+	bucket_key(dir_id, name, &key);
+
+	uint8_t *bucket = fetch_record_alloc(&key, DIR_KEY_SIZE, &size);
+
+	if (bucket == NULL)
+		return -ENOENT;
+
+	int found = find_in_bucket(bucket, size, name, &entry);
+
+	free(bucket);
+
+	if (found < 0)
+		return -ENOENT;
+
+	uuid_copy(id, entry.id);
+
+	return 0;
+}
+
+// Add an entry of the given mode, growing the directory by a page when
+// none has room for it. Returns 0, or -EEXIST if the name is taken.
+int dir_add(uuid_t dir_id, const char *name, uuid_t id, mode_t mode) {
+	dir_fcb dir;
+	dir_page page;
+	dir_key key;
+	dir_hash_entry existing;
+	size_t size = 0;
+
+	// The bucket of the name tells whether it is taken, and is where the
+	// new entry gets indexed
+	bucket_key(dir_id, name, &key);
+
+	uint8_t *bucket = fetch_record_alloc(&key, DIR_KEY_SIZE, &size);
+
+	if (bucket != NULL && find_in_bucket(bucket, size, name, &existing) >= 0) {
+		free(bucket);
+		return -EEXIST;
+	}
+
+	fetch_data(dir_id, &dir, sizeof(dir_fcb));
+
+	// Pages before free_hint had no room at the last insert
+	for (uint32_t p = dir.free_hint; p < dir.page_count; p++) {
+		fetch_dir_page(&dir, p, &page);
+
+		int offset = page_insert(&page, name, id, IFTODT(mode));
+
+		if (offset >= 0) {
+			store_dir_page(&dir, p, &page);
+			index_entry(&key, bucket, size, name, id, p, offset);
+
+			if (dir.free_hint != p) {
+				dir.free_hint = p;
+				store_data(dir.id, &dir, sizeof(dir_fcb));
+			}
+
+			return 0;
+		}
+	}
+
+	write_log("Directory grown to %d pages\n", dir.page_count + 1);
+
+	empty_dir_page(&page);
+	page_insert(&page, name, id, IFTODT(mode));
+	store_dir_page(&dir, dir.page_count, &page);
+	index_entry(&key, bucket, size, name, id, dir.page_count, 0);
+
+	dir.free_hint = dir.page_count;
+	dir.page_count++;
+	store_data(dir.id, &dir, sizeof(dir_fcb));
+
+	return 0;
+}
+
+// Remove the entry called name. Returns 0 and the inode id it held, or -ENOENT.
+int dir_remove(uuid_t dir_id, const char *name, uuid_t id) {
+	dir_key key;
+	dir_hash_entry entry;
+	size_t size;
+
+	bucket_key(dir_id, name, &key);
+
+	uint8_t *bucket = fetch_record_alloc(&key, DIR_KEY_SIZE, &size);
+
+	if (bucket == NULL)
+		return -ENOENT;
+
+	int found = find_in_bucket(bucket, size, name, &entry);
+
+	if (found < 0) {
+		free(bucket);
+		return -ENOENT;
+	}
+
+	// Dropping the entry from its bucket, and the bucket once it is empty
+	size_t entry_size = sizeof(dir_hash_entry) + entry.name_len;
+
+	memmove(bucket + found, bucket + found + entry_size, size - found - entry_size);
+	size -= entry_size;
+
+	if (size > 0)
+		store_record(&key, DIR_KEY_SIZE, bucket, size);
+	else
+		delete_record(&key, DIR_KEY_SIZE);
+
+	free(bucket);
+
+	dir_fcb dir;
+	dir_page page;
+
+	fetch_data(dir_id, &dir, sizeof(dir_fcb));
+	fetch_dir_page(&dir, entry.page, &page);
+
+	uuid_copy(id, entry.id);
+
+	page_remove(&page, entry.offset);
+	store_dir_page(&dir, entry.page, &page);
+
+	if (entry.page < dir.free_hint) {
+		dir.free_hint = entry.page;
+		store_data(dir.id, &dir, sizeof(dir_fcb));
+	}
+
+	return 0;
+}
+
+// Call fill for every entry from position from on, until it returns
+// non-zero. The position of an entry is page * DIR_PAGE_SIZE + offset.
+// Entries never move, so a walk can be picked up later from the position
+// after the last entry it passed, even if the directory changed since.
+void dir_iterate(uuid_t dir_id, uint64_t from, dir_fill_fn fill, void *arg) {
+	dir_fcb dir;
+	dir_page page;
+	char name[MAX_NAME_SIZE];
+
+	fetch_data(dir_id, &dir, sizeof(dir_fcb));
+
+	for (uint32_t p = from / DIR_PAGE_SIZE; p < dir.page_count; p++) {
+		fetch_dir_page(&dir, p, &page);
+
+		for (uint32_t offset = 0; offset < DIR_PAGE_SIZE; offset += entry_at(&page, offset)->rec_len) {
+			dir_entry *entry = entry_at(&page, offset);
+			uint64_t position = (uint64_t) p * DIR_PAGE_SIZE + offset;
+
+			if (entry->name_len == 0 || position < from)
+				continue;
+
+			memcpy(name, entry->name, entry->name_len);
+			name[entry->name_len] = '\0';
+
+			if (fill(name, entry->id, entry->type, position, arg) != 0)
+				return;
+		}
+	}
+}
+
+static int found_entry(const char *name, uuid_t id, uint8_t type, uint64_t position, void *arg) {
+	*(int *) arg = 1;
+	return 1;
+}
+
+int dir_is_empty(uuid_t dir_id) {
+	int found = 0;
+
+	dir_iterate(dir_id, 0, found_entry, &found);
+
+	return !found;
+}
+
+// Delete the fcb and every page of a directory. The directory is empty,
+// so its name index has no buckets left.
+void dir_release(uuid_t data_id) {
+	dir_fcb dir;
+	dir_key key;
+
+	fetch_data(data_id, &dir, sizeof(dir_fcb));
+
+	for (uint32_t p = 0; p < dir.page_count; p++) {
+		page_key(dir.id, p, &key);
+		delete_record(&key, DIR_KEY_SIZE);
+	}
+
+	delete_record(data_id, KEY_SIZE);
+}
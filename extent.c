@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Recently used extent pages, so walking the upper levels of a large
+// tree does not cost a fetch per level. Pages are written through.
+typedef struct cached_page {
+	int valid;
+	uint64_t id;
+	extent_page page;
+
+} cached_page;
+
+static cached_page page_cache[EXTENT_CACHE_SIZE];
+static pthread_mutex_t page_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Nodes visited on the way from the fcb down to a leaf. Node 0 is the fcb
+// itself and node k (k > 0) is pages[k - 1].
+typedef struct extent_path {
+	extent_page pages[EXTENT_MAX_DEPTH];
+	int slots[EXTENT_MAX_DEPTH + 1]; /* entry followed (or found) in each node */
+	uint64_t limit; /* no extent starts between the searched block and this one */
+
+} extent_path;
+
+
+static cached_page *cache_slot(uint64_t id) {
+	return &page_cache[id % EXTENT_CACHE_SIZE];
+}
+
+static void fetch_page(uint64_t id, extent_page *page) {
+	pthread_mutex_lock(&page_cache_lock);
+
+	cached_page *cached = cache_slot(id);
+
+	if (cached->valid && cached->id == id) {
+		memcpy(page, &cached->page, sizeof(extent_page));
+		pthread_mutex_unlock(&page_cache_lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&page_cache_lock);
+
+	fetch_record(&id, BLOCK_KEY_SIZE, page, sizeof(extent_page));
+
+	pthread_mutex_lock(&page_cache_lock);
+
+	cached = cache_slot(id);
+	cached->valid = 1;
+	cached->id = id;
+	memcpy(&cached->page, page, sizeof(extent_page));
+
+	pthread_mutex_unlock(&page_cache_lock);
+}
+
+static void store_page(uint64_t id, extent_page *page) {
+	store_record(&id, BLOCK_KEY_SIZE, page, sizeof(extent_page));
+
+	pthread_mutex_lock(&page_cache_lock);
+
+	cached_page *cached = cache_slot(id);
+	cached->valid = 1;
+	cached->id = id;
+	memcpy(&cached->page, page, sizeof(extent_page));
+
+	pthread_mutex_unlock(&page_cache_lock);
+}
+
+static extent *node_entries(fcb *map, extent_path *path, int node) {
+	return node == 0 ? map->entries : path->pages[node - 1].entries;
+}
+
+static uint32_t *node_count(fcb *map, extent_path *path, int node) {
+	return node == 0 ? &map->count : &path->pages[node - 1].count;
+}
+
+static uint32_t node_capacity(int node) {
+	return node == 0 ? FCB_EXTENT_NUMBER : EXTENT_PAGE_ENTRIES;
+}
+
+// Index of the last entry starting at or before file_block, -1 if there is none
+static int find_slot(const extent *entries, uint32_t count, uint32_t file_block) {
+	int low = 0;
+	int high = (int) count - 1;
+	int slot = -1;
+
+	while (low <= high) {
+		int middle = (low + high) / 2;
+
+		if (entries[middle].file_block <= file_block) {
+			slot = middle;
+			low = middle + 1;
+		}
+		else
+			high = middle - 1;
+	}
+
+	return slot;
+}
+
+// Walk from the fcb down to the leaf responsible for file_block
+static void descend(fcb *map, uint32_t file_block, extent_path *path) {
+	path->limit = EXTENT_NONE;
+
+	for (uint32_t node = 0; node <= map->depth; node++) {
+		extent *entries = node_entries(map, path, node);
+		uint32_t count = *node_count(map, path, node);
+		int slot = find_slot(entries, count, file_block);
+
+		if (slot + 1 < (int) count && entries[slot + 1].file_block < path->limit)
+			path->limit = entries[slot + 1].file_block;
+
+		path->slots[node] = slot;
+
+		if (node == map->depth)
+			break;
+
+		// The first child also covers the blocks before its first extent
+		if (slot < 0)
+			path->slots[node] = slot = 0;
+
+		fetch_page(entries[slot].start, &path->pages[node]);
+	}
+}
+
+// Page keys are kept in the parent entries, the fcb is stored by the caller
+static void store_node(fcb *map, extent_path *path, int node) {
+	if (node > 0)
+		store_page(node_entries(map, path, node - 1)[path->slots[node - 1]].start, &path->pages[node - 1]);
+}
+
+// Put entry at position pos of a node, splitting full pages on the way up
+static void insert_entry(fcb *map, extent_path *path, int node, int pos, const extent *entry) {
+	extent *entries = node_entries(map, path, node);
+	uint32_t *count = node_count(map, path, node);
+
+	if (*count < node_capacity(node)) {
+		memmove(&entries[pos + 1], &entries[pos], (*count - pos) * sizeof(extent));
+		entries[pos] = *entry;
+		(*count)++;
+
+		store_node(map, path, node);
+		return;
+	}
+
+	// The fcb is never full here, extent_map_block grows the tree first
+	extent_page right;
+	extent separator;
+	uint32_t half = *count / 2;
+
+	memset(&right, 0, sizeof(extent_page));
+	right.level = path->pages[node - 1].level;
+	right.count = *count - half;
+	memcpy(right.entries, &entries[half], right.count * sizeof(extent));
+	*count = half;
+
+	if (pos <= (int) half) {
+		memmove(&entries[pos + 1], &entries[pos], (*count - pos) * sizeof(extent));
+		entries[pos] = *entry;
+		(*count)++;
+	}
+	else {
+		pos -= half;
+		memmove(&right.entries[pos + 1], &right.entries[pos], (right.count - pos) * sizeof(extent));
+		right.entries[pos] = *entry;
+		right.count++;
+	}
+
+	memset(&separator, 0, sizeof(extent));
+	separator.file_block = right.entries[0].file_block;
+	separator.start = allocate_blocks(1);
+
+	write_log("Splitting extent page on level %d\n", right.level);
+
+	store_node(map, path, node);
+	store_page(separator.start, &right);
+
+	insert_entry(map, path, node - 1, path->slots[node - 1] + 1, &separator);
+}
+
+// Whether inserting into the current leaf would have to split the fcb
+static int path_is_full(fcb *map, extent_path *path) {
+	for (int node = map->depth; node >= 0; node--) {
+		if (*node_count(map, path, node) < node_capacity(node))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Move the entries of the fcb into a new page, adding a level to the tree
+static int grow_tree(fcb *map) {
+	if (map->depth == EXTENT_MAX_DEPTH)
+		return -EFBIG;
+
+	extent_page page;
+
+	memset(&page, 0, sizeof(extent_page));
+	page.level = map->depth;
+	page.count = map->count;
+	memcpy(page.entries, map->entries, map->count * sizeof(extent));
+
+	memset(map->entries, 0, sizeof(map->entries));
+	map->entries[0].start = allocate_blocks(1);
+	map->count = 1;
+	map->depth++;
+
+	write_log("Extent tree grown to depth %d\n", map->depth);
+
+	store_page(map->entries[0].start, &page);
+
+	return 0;
+}
+
+// Storage key of a block that belongs to extent e
+void extent_block_key(const extent *e, uint32_t file_block, block_key *key) {
+	*key = e->start + (file_block - e->file_block);
+}
+
+// Find the extent that maps file_block. Returns 1 and fills found if the
+// block is mapped, 0 if it is a hole.
+int extent_lookup(fcb *map, uint32_t file_block, extent *found) {
+	extent_path path;
+
+	descend(map, file_block, &path);
+
+	int slot = path.slots[map->depth];
+
+	if (slot < 0)
+		return 0;
+
+	extent *e = &node_entries(map, &path, map->depth)[slot];
+
+	if (file_block >= e->file_block + e->length)
+		return 0;
+
+	*found = *e;
+
+	return 1;
+}
+
+// Map up to count blocks starting at file_block, which is not mapped yet,
+// either by extending the extent that ends right before it or by adding a
+// new extent. Mapping stops before the next mapped block. Returns the
+// number of blocks mapped and the extent now holding them in mapped. The
+// caller stores the fcb.
+int extent_map_blocks(fcb *map, uint32_t file_block, uint32_t count, extent *mapped) {
+	extent_path path;
+
+	descend(map, file_block, &path);
+
+	if (count > path.limit - file_block)
+		count = path.limit - file_block;
+
+	int slot = path.slots[map->depth];
+	extent *entries = node_entries(map, &path, map->depth);
+
+	// Growing an extent needs the block numbers right after it to be free
+	if (slot >= 0 && entries[slot].file_block + entries[slot].length == file_block
+			&& extend_allocation(entries[slot].start + entries[slot].length, count)) {
+		entries[slot].length += count;
+		*mapped = entries[slot];
+
+		store_node(map, &path, map->depth);
+		return count;
+	}
+
+	if (path_is_full(map, &path)) {
+		int rc = grow_tree(map);
+
+		if (rc != 0) {
+			write_log("Extent tree of the file is full\n");
+			return rc;
+		}
+
+		descend(map, file_block, &path);
+		slot = path.slots[map->depth];
+	}
+
+	memset(mapped, 0, sizeof(extent));
+	mapped->file_block = file_block;
+	mapped->length = count;
+	mapped->start = allocate_blocks(count);
+
+	insert_entry(map, &path, map->depth, slot + 1, mapped);
+
+	return count;
+}
+
+// Hand every block below a node, pages included, to release. The node's
+// children are height levels above the leaves.
+static void release_entries(extent *entries, uint32_t count, uint32_t height, extent_release_fn release, void *arg) {
+	for (uint32_t i = 0; i < count; i++) {
+		if (height == 0) {
+			release(entries[i].start, entries[i].length, 0, arg);
+			continue;
+		}
+
+		extent_page page;
+
+		fetch_page(entries[i].start, &page);
+		release_entries(page.entries, page.count, height - 1, release, arg);
+		release(entries[i].start, 1, 1, arg);
+	}
+}
+
+// Drop the mappings of blocks from first_block on below a node whose
+// children are height levels above the leaves. Returns the new count.
+static uint32_t truncate_entries(extent *entries, uint32_t count, uint32_t height, uint32_t first_block, extent_release_fn release, void *arg) {
+	if (height == 0) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (entries[i].file_block >= first_block) {
+				release_entries(&entries[i], count - i, 0, release, arg);
+				return i;
+			}
+
+			if (entries[i].file_block + entries[i].length > first_block) {
+				uint32_t kept = first_block - entries[i].file_block;
+
+				release(entries[i].start + kept, entries[i].length - kept, 0, arg);
+				entries[i].length = kept;
+			}
+		}
+
+		return count;
+	}
+
+	// Children starting at or after first_block go entirely, the one
+	// before them is cut. The first child is kept even when emptied.
+	uint32_t i = count - 1;
+
+	while (i > 0 && entries[i].file_block >= first_block)
+		i--;
+
+	release_entries(&entries[i + 1], count - i - 1, height, release, arg);
+
+	extent_page page;
+
+	fetch_page(entries[i].start, &page);
+	page.count = truncate_entries(page.entries, page.count, height - 1, first_block, release, arg);
+	store_page(entries[i].start, &page);
+
+	return i + 1;
+}
+
+// Unmap every block from first_block to the end of the file, handing the
+// blocks and pages that are no longer used to release. The caller stores
+// the fcb.
+void extent_truncate(fcb *map, uint32_t first_block, extent_release_fn release, void *arg) {
+	if (first_block == 0) {
+		extent_release_all(map, release, arg);
+		memset(map, 0, sizeof(fcb));
+		return;
+	}
+
+	map->count = truncate_entries(map->entries, map->count, map->depth, first_block, release, arg);
+}
+
+// Hand every block and page of the tree to release
+void extent_release_all(fcb *map, extent_release_fn release, void *arg) {
+	release_entries(map->entries, map->count, map->depth, release, arg);
+}
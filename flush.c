@@ -0,0 +1,100 @@
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Write-back of the caches. Changed records wait in the buffer (buffer.c),
+// dirty inodes in the inode cache (inode.c) and the superblock in memory,
+// and the flusher thread writes them all in one go every flush_interval
+// seconds, or as soon as a cache asks for it by calling wake_flusher.
+unsigned int flush_interval = DEFAULT_FLUSH_INTERVAL;
+size_t dirty_limit = (size_t) DEFAULT_DIRTY_LIMIT << 20;
+
+static pthread_t flusher;
+static pthread_mutex_t flush_running = PTHREAD_MUTEX_INITIALIZER; /* one flush at a time */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_wanted = PTHREAD_COND_INITIALIZER;
+static int wanted; /* a flush was asked for since the last one started */
+static int stopping;
+
+
+// Write every buffered change to the store
+void flush_all() {
+	superblock copy;
+
+	pthread_mutex_lock(&flush_running);
+
+	// Changes are taken over between transactions, with the inodes and the
+	// superblock they changed
+	pause_changes();
+
+	write_back_inodes();
+
+	if (take_superblock(&copy))
+		store_record(SUPERBLOCK_KEY, SUPERBLOCK_KEY_SIZE, &copy, sizeof(superblock));
+
+	int taken = buffer_take();
+
+	resume_changes();
+
+	// Operations go on meanwhile, into a buffer of their own
+	if (taken)
+		buffer_write();
+
+	pthread_mutex_unlock(&flush_running);
+}
+
+// Have the flusher start a flush now rather than at its next interval
+void wake_flusher() {
+	pthread_mutex_lock(&flush_lock);
+	wanted = 1;
+	pthread_cond_signal(&flush_wanted);
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static void *flush_loop(void *arg) {
+	pthread_mutex_lock(&flush_lock);
+
+	while (!stopping) {
+		if (!wanted) {
+			struct timespec deadline;
+
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += flush_interval;
+
+			pthread_cond_timedwait(&flush_wanted, &flush_lock, &deadline);
+		}
+
+		wanted = 0;
+
+		// Caches wake the flusher with their own locks held
+		pthread_mutex_unlock(&flush_lock);
+		flush_all();
+		pthread_mutex_lock(&flush_lock);
+	}
+
+	pthread_mutex_unlock(&flush_lock);
+
+	return NULL;
+}
+
+// Started from the FUSE init callback, like the reclaimer
+void start_flusher() {
+	stopping = 0;
+
+	if (pthread_create(&flusher, NULL, flush_loop, NULL) != 0) {
+		write_log("myfs - cannot start the flusher thread\n");
+		exit(-1);
+	}
+}
+
+// Stop the thread and write back whatever is still dirty
+void stop_flusher() {
+	pthread_mutex_lock(&flush_lock);
+	stopping = 1;
+	pthread_cond_signal(&flush_wanted);
+	pthread_mutex_unlock(&flush_lock);
+
+	pthread_join(flusher, NULL);
+
+	flush_all();
+}
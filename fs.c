@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "fs.h"
 
 unqlite *pDb;
@@ -8,6 +10,52 @@ unqlite *pDb;
 struct rootS root_object;
 int root_is_empty;
 
+superblock super_block;
+
+// Changes are buffered (buffer.c) and written by the flusher, which only
+// takes them over between transactions, so that it writes every
+// transaction whole. A thread may nest transactions.
+static pthread_mutex_t change_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changes_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t changes_resumed = PTHREAD_COND_INITIALIZER;
+static int changing; /* threads within a transaction */
+static int paused;
+static __thread int transaction_depth;
+
+// The superblock in memory is the current one, a flush writes it to the
+// store if it has changed
+static pthread_mutex_t superblock_lock = PTHREAD_MUTEX_INITIALIZER;
+static int superblock_dirty;
+
+// Records are spread over shard_count databases, each used by one thread
+// at a time. The first one, pDb, also holds the root object and the
+// superblock.
+struct store_shard {
+	unqlite *db;
+	pthread_mutex_t lock;
+	int touched; /* written to since its last commit */
+};
+
+static struct store_shard shards[MAX_SHARD_COUNT];
+static unsigned int shard_count = 1;
+
+// Data blocks of files are kept in databases of their own, as many as there
+// are for the metadata, so that bulk writes do not grow the hash of the
+// metadata. Stores formatted before keep them with the metadata.
+static struct store_shard data_shards[MAX_SHARD_COUNT];
+static struct store_shard *block_shards = shards;
+
+// Name of the first database of data blocks asked for on the command line,
+// NULL if none was. The others get their number appended like those of the
+// metadata.
+const char *data_database_name;
+
+// Block size used when a new store is formatted; ignored for existing stores
+unsigned int format_block_size = DEFAULT_BLOCK_SIZE;
+
+// Number of databases a new store is spread over; ignored for existing stores
+unsigned int format_shard_count = DEFAULT_SHARD_COUNT;
+
 uuid_t zero_uuid;
 
 FILE *logfile;
@@ -24,10 +72,13 @@ FILE *init_log_file(){
     return logfile;
 }
 
+// Uses the log file directly rather than the FUSE private data, so that
+// threads of our own can log too
 void write_log(const char *format, ...){
     va_list ap;
     va_start(ap, format);
-    vfprintf(NEWFS_PRIVATE_DATA->logfile, format, ap);
+    vfprintf(logfile, format, ap);
+    va_end(ap);
 }
 
 void error_handler(int rc){
@@ -47,6 +98,30 @@ void error_handler(int rc){
 	}
 }
 
+//Hash of an id for the tables and databases keyed by them. Ids are random,
+//any four bytes of them hash well.
+uint32_t uuid_hash(const uuid_t id){
+	uint32_t hash;
+
+	memcpy(&hash, id, sizeof(hash));
+
+	return hash;
+}
+
+//FNV-1a hash of size bytes, going on from seed. Start from FNV1A_SEED, or
+//from the hash of what comes before to hash several pieces as one.
+uint32_t fnv1a(uint32_t seed, const void *data, size_t size){
+	const uint8_t *bytes = data;
+	uint32_t hash = seed;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
 void print_id(uuid_t *id){
  	size_t i; 
     for (i = 0; i < sizeof *id; i ++) {
@@ -54,16 +129,53 @@ void print_id(uuid_t *id){
     }
 }
 
+//Open database number i of a set named base. The first one is called base
+//and the others get their number appended. Unless create is set a missing
+//database is an error, since UnQLite would quietly start an empty one.
+static void open_shard(struct store_shard *set, const char *base, unsigned int i, int create){
+	char *name = malloc(strlen(base) + 12);
+	int missing;
+	int rc;
+
+	if (i == 0)
+		strcpy(name, base);
+	else
+		sprintf(name, "%s.%u", base, i);
+
+	missing = access(name, F_OK) != 0;
+
+	if(missing && !create){
+		printf("init_store: database %s is missing\n", name);
+		exit(-1);
+	}
+
+	pthread_mutex_init(&set[i].lock, NULL);
+
+	rc = unqlite_open(&set[i].db,name,UNQLITE_OPEN_CREATE);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+
+	// UnQLite only creates the file once something is committed to it
+	if(missing){
+		rc = unqlite_begin(set[i].db);
+		if( rc == UNQLITE_OK ){ rc = unqlite_commit(set[i].db); }
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+	}
+
+	free(name);
+}
+
+static int replay_journal();
+
 //Initialise the store. If no root object is found, create one and write it to the store.
 void init_store(){
 	int rc;
 	printf("init_store\n");
 	
 	uuid_clear(zero_uuid);
-	
-	// Open the database.
-	rc = unqlite_open(&pDb,DATABASE_NAME,UNQLITE_OPEN_CREATE);
-	if( rc != UNQLITE_OK ){ error_handler(rc); }
+
+	// Open the first database, which tells how many there are.
+	open_shard(shards, DATABASE_NAME, 0, 1);
+	pDb = shards[0].db;
 
 	// Does root already exist?
 	rc = read_root();
@@ -92,15 +204,441 @@ void init_store(){
 		 	error_handler(rc);
 		 }
     }
+
+	// Does the superblock already exist?
+	rc = read_superblock();
+	int formatting = rc == UNQLITE_NOTFOUND;
+	if(formatting){
+		const char *data_name = data_database_name != NULL ? data_database_name : DATA_DATABASE_NAME;
+
+		if(strlen(data_name) >= DATA_DATABASE_NAME_SIZE){
+			printf("init_store: data database name %s is too long\n", data_name);
+			exit(-1);
+		}
+
+		// Format the store with the requested block size.
+		super_block.magic = SUPERBLOCK_MAGIC;
+		super_block.block_size = format_block_size;
+		// Block number 0 is never handed out
+		super_block.next_block = 1;
+		super_block.shard_count = format_shard_count;
+		super_block.flags = SUPERBLOCK_DATA_STORE;
+		strcpy(super_block.data_database, data_name);
+		rc = write_superblock();
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+		printf("init_store: superblock created with block size %u\n", super_block.block_size);
+	}else{
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+		if(super_block.magic != SUPERBLOCK_MAGIC){
+			printf("init_store: superblock is corrupted\n");
+			exit(-1);
+		}
+		// Offsets are worked out from the block size, so it must be one
+		// a store could have been formatted with
+		if(super_block.block_size < MIN_BLOCK_SIZE || super_block.block_size > MAX_BLOCK_SIZE || (super_block.block_size & (super_block.block_size - 1)) != 0){
+			printf("init_store: superblock has an invalid block size %u\n", super_block.block_size);
+			exit(-1);
+		}
+		printf("init_store: superblock found with block size %u\n", super_block.block_size);
+	}
+
+	if(super_block.shard_count > MAX_SHARD_COUNT){
+		printf("init_store: superblock has an invalid shard count %u\n", super_block.shard_count);
+		exit(-1);
+	}
+
+	// Stores formatted before sharding have a single database
+	shard_count = super_block.shard_count > 0 ? super_block.shard_count : 1;
+
+	// Every database of a store is created when it is formatted. Stores
+	// formatted before the name of the data databases was recorded may
+	// lack those nothing was ever written to.
+	int creating = formatting || super_block.data_database[0] == '\0';
+
+	for (unsigned int i = 1; i < shard_count; i++)
+		open_shard(shards, DATABASE_NAME, i, creating);
+
+	printf("init_store: records spread over %u databases\n", shard_count);
+
+	// A flush may have stopped half way through writing its records
+	if(replay_journal()){
+		printf("init_store: unfinished flush completed from the journal\n");
+
+		rc = read_superblock();
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+	}
+
+	if(super_block.flags & SUPERBLOCK_DATA_STORE){
+		// The data blocks are where the store was formatted to keep them
+		const char *data_name = super_block.data_database;
+
+		if(data_name[0] == '\0'){
+			data_name = data_database_name != NULL ? data_database_name : DATA_DATABASE_NAME;
+
+			// Record it with the next flush, now that all of them exist
+			if(strlen(data_name) < DATA_DATABASE_NAME_SIZE){
+				strcpy(super_block.data_database, data_name);
+				superblock_dirty = 1;
+			}
+		}else if(data_database_name != NULL && strcmp(data_database_name, data_name) != 0){
+			printf("init_store: data blocks are kept in %s, not %s\n", data_name, data_database_name);
+			exit(-1);
+		}
+
+		for (unsigned int i = 0; i < shard_count; i++)
+			open_shard(data_shards, data_name, i, creating);
+
+		block_shards = data_shards;
+		printf("init_store: data blocks kept in %s\n", data_name);
+	}
+}
+
+static void close_shards(struct store_shard *set){
+	for (unsigned int i = 0; i < shard_count; i++) {
+		unqlite_close(set[i].db);
+		pthread_mutex_destroy(&set[i].lock);
+	}
+}
+
+void close_store(){
+	if(block_shards != shards)
+		close_shards(block_shards);
+
+	close_shards(shards);
+}
+
+//Database of the metadata a record is kept in. Extent pages are keyed by
+//their number, and runs of SHARD_BLOCK_RUN of them share a database, so a
+//write mostly commits one. Records keyed by an id, or by an id followed by
+//more, go by the id. The root object and the superblock are in the first.
+static struct store_shard *shard_of(const void *key, int key_size){
+	if(key_size == sizeof(uint64_t)){
+		uint64_t number;
+
+		memcpy(&number, key, sizeof(number));
+
+		return &shards[(number / SHARD_BLOCK_RUN) % shard_count];
+	}
+
+	if(key_size >= KEY_SIZE)
+		return &shards[uuid_hash(key) % shard_count];
+
+	return &shards[0];
+}
+
+//Take exclusive use of the database holding a record and return it.
+unqlite *lock_shard(const void *key, int key_size){
+	struct store_shard *shard = shard_of(key, key_size);
+
+	pthread_mutex_lock(&shard->lock);
+
+	return shard->db;
+}
+
+void unlock_shard(const void *key, int key_size){
+	pthread_mutex_unlock(&shard_of(key, key_size)->lock);
+}
+
+//Take exclusive use of the database holding a data block and return it.
+//Blocks are spread like extent pages.
+unqlite *lock_data_shard(uint64_t block){
+	struct store_shard *shard = &block_shards[(block / SHARD_BLOCK_RUN) % shard_count];
+
+	pthread_mutex_lock(&shard->lock);
+
+	return shard->db;
+}
+
+void unlock_data_shard(uint64_t block){
+	pthread_mutex_unlock(&block_shards[(block / SHARD_BLOCK_RUN) % shard_count].lock);
 }
 
 //Read the root object from the store.
 int read_root(){
-	return unqlite_kv_fetch(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE_P);
+	unqlite *db = lock_shard(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE);
+	int rc = unqlite_kv_fetch(db,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE_P);
+	unlock_shard(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE);
+	return rc;
 }
 
 //Write the root object to the store.
 int write_root(){
-	return unqlite_kv_store(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE);
+	unqlite *db = lock_shard(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE);
+	shard_of(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE)->touched = 1;
+	int rc = unqlite_kv_store(db,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE);
+	unlock_shard(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE);
+	return rc;
+}
+
+
+//Read the superblock from the store. Fields added since it was written read as zero.
+int read_superblock(){
+	unqlite_int64 nBytes = sizeof(superblock);
+	memset(&super_block, 0, sizeof(superblock));
+	unqlite *db = lock_shard(SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE);
+	int rc = unqlite_kv_fetch(db,SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE,&super_block,&nBytes);
+	unlock_shard(SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE);
+	return rc;
+}
+
+//Write the superblock to the store.
+int write_superblock(){
+	unqlite *db = lock_shard(SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE);
+	shard_of(SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE)->touched = 1;
+	int rc = unqlite_kv_store(db,SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE,&super_block,sizeof(superblock));
+	unlock_shard(SUPERBLOCK_KEY,SUPERBLOCK_KEY_SIZE);
+	return rc;
+}
+
+//Group the following changes into one transaction, which a flush writes
+//whole or not at all. Waits while a flush takes the changes over.
+void begin_transaction(){
+	if(transaction_depth++ > 0)
+		return;
+
+	pthread_mutex_lock(&change_lock);
+
+	while(paused)
+		pthread_cond_wait(&changes_resumed, &change_lock);
+
+	changing++;
+	pthread_mutex_unlock(&change_lock);
+}
+
+//End the transaction begun by begin_transaction(). Its changes are written
+//with the next flush.
+void commit_transaction(){
+	if(--transaction_depth > 0)
+		return;
+
+	pthread_mutex_lock(&change_lock);
+
+	if(--changing == 0 && paused)
+		pthread_cond_signal(&changes_done);
+
+	pthread_mutex_unlock(&change_lock);
+}
+
+//Hold back new transactions and wait for those under way to end, so that
+//the changes buffered so far can be taken over as a whole.
+void pause_changes(){
+	pthread_mutex_lock(&change_lock);
+
+	paused = 1;
+
+	while(changing > 0)
+		pthread_cond_wait(&changes_done, &change_lock);
+
+	pthread_mutex_unlock(&change_lock);
+}
+
+void resume_changes(){
+	pthread_mutex_lock(&change_lock);
+
+	paused = 0;
+	pthread_cond_broadcast(&changes_resumed);
+
+	pthread_mutex_unlock(&change_lock);
+}
+
+//Commit a database if it has been written to since its last commit.
+static void commit_shard(struct store_shard *shard){
+	pthread_mutex_lock(&shard->lock);
+
+	int rc = UNQLITE_OK;
+
+	if(shard->touched)
+		rc = unqlite_commit(shard->db);
+
+	shard->touched = 0;
+	pthread_mutex_unlock(&shard->lock);
+
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+}
+
+//Commit the databases of the metadata that have been written to, the first
+//one last.
+void commit_shards(){
+	for (unsigned int i = shard_count; i-- > 0; )
+		commit_shard(&shards[i]);
 }
 
+//Commit the databases of the data blocks that have been written to.
+void commit_data_shards(){
+	for (unsigned int i = 0; i < shard_count; i++)
+		commit_shard(&block_shards[i]);
+}
+
+//Store or delete a record in the database a set keeps it in. Data blocks
+//go by their number.
+static void write_shard(struct store_shard *shard, const void *key, int key_size, const void *value, size_t size, int deleted){
+	pthread_mutex_lock(&shard->lock);
+
+	int rc = deleted ? unqlite_kv_delete(shard->db, key, key_size) : unqlite_kv_store(shard->db, key, key_size, value, size);
+
+	shard->touched = 1;
+	pthread_mutex_unlock(&shard->lock);
+
+	if( rc != UNQLITE_OK && !(deleted && rc == UNQLITE_NOTFOUND) ){
+		write_log("\nmyfs_database error - writing of a record failed");
+		error_handler(rc);
+	}
+}
+
+static struct store_shard *data_shard_of(const void *key){
+	uint64_t block;
+
+	memcpy(&block, key, sizeof(block));
+
+	return &block_shards[(block / SHARD_BLOCK_RUN) % shard_count];
+}
+
+//Write a data block to its database, for the flusher.
+void save_data_record(const void *key, int key_size, const void *value, size_t size){
+	write_shard(data_shard_of(key), key, key_size, value, size, 0);
+}
+
+//Delete a data block from its database, for the flusher.
+void erase_data_record(const void *key, int key_size){
+	write_shard(data_shard_of(key), key, key_size, NULL, 0, 1);
+}
+
+//Go through the entries of a journal, applying them to the databases of
+//the metadata if apply is set. Returns how many databases they touch.
+static unsigned int walk_journal(const uint8_t *journal, size_t size, int apply){
+	int seen[MAX_SHARD_COUNT] = { 0 };
+	unsigned int touched = 0;
+	size_t offset = 0;
+
+	while(offset + sizeof(journal_entry) <= size){
+		journal_entry entry;
+
+		memcpy(&entry, journal + offset, sizeof(journal_entry));
+
+		if(entry.key_size > size || entry.size > size - entry.key_size || offset + sizeof(journal_entry) + entry.key_size + entry.size > size)
+			break;
+
+		const uint8_t *key = journal + offset + sizeof(journal_entry);
+		struct store_shard *shard = shard_of(key, entry.key_size);
+
+		if(!seen[shard - shards]){
+			seen[shard - shards] = 1;
+			touched++;
+		}
+
+		if(apply)
+			write_shard(shard, key, entry.key_size, key + entry.key_size, entry.size, entry.deleted);
+
+		offset += sizeof(journal_entry) + entry.key_size + entry.size;
+	}
+
+	return touched;
+}
+
+//Write the records of a flush, a run of journal entries, to the databases
+//of the metadata. Each database commits on its own, so when the records
+//are spread over several of them the entries are committed first as a
+//journal in the first database. If the flush stops half way, init_store()
+//applies the journal again. The journal is deleted once every database
+//has committed, the first one last.
+void write_metadata(const uint8_t *journal, size_t size){
+	int journaled = walk_journal(journal, size, 0) > 1;
+
+	if(journaled){
+		write_shard(&shards[0], JOURNAL_KEY, JOURNAL_KEY_SIZE, journal, size, 0);
+		commit_shard(&shards[0]);
+	}
+
+	walk_journal(journal, size, 1);
+
+	if(journaled)
+		write_shard(&shards[0], JOURNAL_KEY, JOURNAL_KEY_SIZE, NULL, 0, 1);
+
+	commit_shards();
+}
+
+//Apply the journal of a flush that did not finish. Returns 1 if there was
+//one and 0 otherwise.
+static int replay_journal(){
+	unqlite_int64 nBytes;
+
+	int rc = unqlite_kv_fetch(shards[0].db, JOURNAL_KEY, JOURNAL_KEY_SIZE, NULL, &nBytes);
+
+	if(rc == UNQLITE_NOTFOUND)
+		return 0;
+
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+
+	uint8_t *journal = malloc(nBytes);
+
+	rc = unqlite_kv_fetch(shards[0].db, JOURNAL_KEY, JOURNAL_KEY_SIZE, journal, &nBytes);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+
+	walk_journal(journal, nBytes, 1);
+	free(journal);
+
+	write_shard(&shards[0], JOURNAL_KEY, JOURNAL_KEY_SIZE, NULL, 0, 1);
+	commit_shards();
+
+	return 1;
+}
+
+//Copy of the superblock if it has changed since it was last taken. Returns
+//1 if it has and 0 otherwise.
+int take_superblock(superblock *copy){
+	pthread_mutex_lock(&superblock_lock);
+
+	int dirty = superblock_dirty;
+
+	if(dirty)
+		memcpy(copy, &super_block, sizeof(superblock));
+
+	superblock_dirty = 0;
+
+	pthread_mutex_unlock(&superblock_lock);
+
+	return dirty;
+}
+
+//Hand out count consecutive block numbers and return the first one.
+uint64_t allocate_blocks(uint64_t count){
+	pthread_mutex_lock(&superblock_lock);
+
+	uint64_t first = super_block.next_block;
+	super_block.next_block += count;
+	superblock_dirty = 1;
+
+	pthread_mutex_unlock(&superblock_lock);
+
+	return first;
+}
+
+//Hand out count more block numbers right after end, if nothing was allocated
+//there yet. Returns 1 on success and 0 otherwise.
+int extend_allocation(uint64_t end, uint64_t count){
+	int extended = 0;
+
+	pthread_mutex_lock(&superblock_lock);
+
+	if(super_block.next_block == end){
+		super_block.next_block += count;
+		superblock_dirty = 1;
+		extended = 1;
+	}
+
+	pthread_mutex_unlock(&superblock_lock);
+
+	return extended;
+}
+
+//Move bytes of data blocks between the live and the dead (waiting to be
+//reclaimed) counters of the superblock.
+void account_space(int64_t live, int64_t dead){
+	pthread_mutex_lock(&superblock_lock);
+
+	super_block.live_bytes += live;
+	super_block.dead_bytes += dead;
+	superblock_dirty = 1;
+
+	pthread_mutex_unlock(&superblock_lock);
+}
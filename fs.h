@@ -19,21 +19,95 @@ extern unqlite_int64 root_object_size_value;
 
 #define KEY_SIZE 16
 
+#define FNV1A_SEED 2166136261u /* hash of nothing, see fnv1a */
+
+#define SUPERBLOCK_KEY "superblock"
+#define SUPERBLOCK_KEY_SIZE 10
+#define SUPERBLOCK_MAGIC 0x6d796673 /* "myfs" */
+
+// Records of a flush that spans several databases, kept in the first one
+// until all of them have committed
+#define JOURNAL_KEY "journal"
+#define JOURNAL_KEY_SIZE 7
+
+// Bounds and default of the block size chosen when the file system is formatted
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1024 * 1024)
+#define DEFAULT_BLOCK_SIZE MIN_BLOCK_SIZE
+
 #define DATABASE_NAME "myfs.db"
+#define DATA_DATABASE_NAME "myfs.data.db" /* default for the data blocks of files */
+#define DATA_DATABASE_NAME_SIZE 256 /* room for its name in the superblock */
+
+// Bounds and default of the number of databases the records of a store are
+// spread over, chosen when the file system is formatted
+#define MAX_SHARD_COUNT 64
+#define DEFAULT_SHARD_COUNT 1
+#define SHARD_BLOCK_RUN 64 /* consecutive block numbers kept in one database */
 
 typedef struct rootS{
 	uuid_t id;
 } *root;
 
+// Per-filesystem parameters, written once when the store is formatted
+typedef struct superblockS {
+	uint32_t magic;
+	uint32_t block_size; /* size of every data block in bytes */
+	uint64_t next_block; /* lowest block number never handed out */
+	uint64_t live_bytes; /* bytes of data blocks in use by files */
+	uint64_t dead_bytes; /* bytes of data blocks waiting to be reclaimed */
+	uint32_t shard_count; /* databases the records are spread over, 0 for one */
+	uint32_t flags; /* SUPERBLOCK_* flags */
+	char data_database[DATA_DATABASE_NAME_SIZE]; /* first database of data blocks, empty if formatted before it was recorded */
+} superblock;
+
+// Data blocks are kept apart from the metadata, in the databases named
+// after data_database
+#define SUPERBLOCK_DATA_STORE 0x1
+
+// Entry of the journal, followed by key_size bytes of key and size bytes
+// of record. A deleted record has no bytes of its own.
+typedef struct journal_entry {
+	uint32_t deleted;
+	uint32_t key_size;
+	uint64_t size;
+} journal_entry;
+
 extern unqlite *pDb;
 extern struct rootS root_object;
 extern int root_is_empty;
+extern superblock super_block;
+extern unsigned int format_block_size;
+extern unsigned int format_shard_count;
+extern const char *data_database_name;
 
 extern void error_handler(int);
 extern int read_root();
 extern int write_root();
+extern int read_superblock();
+extern int write_superblock();
+uint64_t allocate_blocks(uint64_t);
+int extend_allocation(uint64_t, uint64_t);
+void account_space(int64_t, int64_t);
+unqlite *lock_shard(const void *, int);
+void unlock_shard(const void *, int);
+unqlite *lock_data_shard(uint64_t);
+void unlock_data_shard(uint64_t);
+void begin_transaction();
+void commit_transaction();
+void pause_changes();
+void resume_changes();
+void commit_shards();
+void commit_data_shards();
+void save_data_record(const void *, int, const void *, size_t);
+void erase_data_record(const void *, int);
+void write_metadata(const uint8_t *, size_t);
+int take_superblock(superblock *);
+uint32_t uuid_hash(const uuid_t);
+uint32_t fnv1a(uint32_t, const void *, size_t);
 void print_id(uuid_t *);
 void init_store();
+void close_store();
 int update_root();
 
 extern FILE* init_log_file();
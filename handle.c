@@ -0,0 +1,134 @@
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Files the kernel holds open. Opening a file hands the kernel its
+// open_file in fi->fh, shared by every open of the file. While a file is
+// open its inode stays in the inode cache and its block map is kept here,
+// so reads and writes fetch neither. The map is written through by
+// store_map and dropped with the last handle.
+typedef struct open_file {
+	uuid_t id; /* inode of the file */
+	int handles;
+
+	int has_map;
+	fcb map;
+
+	struct open_file *next;
+
+} open_file;
+
+static open_file *open_files[OPEN_FILE_HASH_SIZE];
+static pthread_mutex_t open_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static open_file **id_slot(const uuid_t id) {
+	return &open_files[uuid_hash(id) % OPEN_FILE_HASH_SIZE];
+}
+
+static open_file *find_open(const uuid_t id) {
+	open_file *file = *id_slot(id);
+
+	while (file != NULL && uuid_compare(file->id, id) != 0)
+		file = file->next;
+
+	return file;
+}
+
+// Handle for a new open of the file with the given inode id
+uint64_t handle_open(uuid_t id) {
+	pin_inode(id);
+
+	pthread_mutex_lock(&open_file_lock);
+
+	open_file *file = find_open(id);
+
+	if (file == NULL) {
+		file = calloc(1, sizeof(open_file));
+		uuid_copy(file->id, id);
+
+		file->next = *id_slot(id);
+		*id_slot(id) = file;
+	}
+
+	file->handles++;
+
+	pthread_mutex_unlock(&open_file_lock);
+
+	return (uint64_t) (uintptr_t) file;
+}
+
+void handle_release(uint64_t fh) {
+	open_file *file = (open_file *) (uintptr_t) fh;
+	uuid_t id;
+
+	pthread_mutex_lock(&open_file_lock);
+
+	uuid_copy(id, file->id);
+
+	if (--file->handles == 0) {
+		open_file **link = id_slot(id);
+
+		while (*link != file)
+			link = &(*link)->next;
+
+		*link = file->next;
+		free(file);
+	}
+
+	pthread_mutex_unlock(&open_file_lock);
+
+	unpin_inode(id);
+}
+
+// Inode id of the file a handle was opened for
+void handle_id(uint64_t fh, uuid_t id) {
+	uuid_copy(id, ((open_file *) (uintptr_t) fh)->id);
+}
+
+// Fetching the block map of a file, kept in memory while the file is open
+void fetch_map(const i_node *node, fcb *map) {
+	pthread_mutex_lock(&open_file_lock);
+
+	open_file *file = find_open(node->id);
+
+	if (file != NULL && file->has_map) {
+		memcpy(map, &file->map, sizeof(fcb));
+		pthread_mutex_unlock(&open_file_lock);
+		return;
+	}
+
+	pthread_mutex_unlock(&open_file_lock);
+
+	fetch_data((unsigned char *) node->data_id, map, sizeof(fcb));
+
+	pthread_mutex_lock(&open_file_lock);
+
+	// Maps only change with the map of the file locked (lock_map), or the
+	// whole file, so a map stored meanwhile is already kept and the
+	// fetched one must not replace it
+	file = find_open(node->id);
+
+	if (file != NULL && !file->has_map) {
+		memcpy(&file->map, map, sizeof(fcb));
+		file->has_map = 1;
+	}
+
+	pthread_mutex_unlock(&open_file_lock);
+}
+
+// Storing the block map of a file
+void store_map(const i_node *node, fcb *map) {
+	store_data((unsigned char *) node->data_id, map, sizeof(fcb));
+
+	pthread_mutex_lock(&open_file_lock);
+
+	open_file *file = find_open(node->id);
+
+	if (file != NULL) {
+		memcpy(&file->map, map, sizeof(fcb));
+		file->has_map = 1;
+	}
+
+	pthread_mutex_unlock(&open_file_lock);
+}
@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Inodes in use are kept in memory. store_inode only changes the cached
+// copy and marks it dirty, so repeated updates of an inode cost a single
+// write. Dirty inodes are written back into the buffer of changes
+// (buffer.c) by sync_inode, on release, and by the flusher thread
+// (flush.c) before each flush.
+//
+// Only clean inodes are evicted, in least recently used order, and never
+// the pinned inodes of open files. When too many are dirty the cache goes
+// over INODE_CACHE_SIZE and wakes the flusher early.
+typedef struct cached_inode {
+	i_node node;
+	int dirty;
+	int pins; /* open files holding the inode */
+
+	struct cached_inode *hash_next;
+	struct cached_inode *lru_prev; /* towards the most recently used */
+	struct cached_inode *lru_next;
+
+} cached_inode;
+
+static cached_inode *inode_hash[INODE_HASH_SIZE];
+static cached_inode *lru_head;
+static cached_inode *lru_tail;
+static int cached_count;
+static int dirty_count;
+static unsigned long evictions;
+
+static pthread_mutex_t inode_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static cached_inode **hash_slot(const uuid_t id) {
+	return &inode_hash[uuid_hash(id) % INODE_HASH_SIZE];
+}
+
+static void lru_unlink(cached_inode *cached) {
+	if (cached->lru_prev != NULL)
+		cached->lru_prev->lru_next = cached->lru_next;
+	else
+		lru_head = cached->lru_next;
+
+	if (cached->lru_next != NULL)
+		cached->lru_next->lru_prev = cached->lru_prev;
+	else
+		lru_tail = cached->lru_prev;
+}
+
+static void lru_push(cached_inode *cached) {
+	cached->lru_prev = NULL;
+	cached->lru_next = lru_head;
+
+	if (lru_head != NULL)
+		lru_head->lru_prev = cached;
+	else
+		lru_tail = cached;
+
+	lru_head = cached;
+}
+
+// Cached copy of an inode, made the most recently used one
+static cached_inode *lookup(const uuid_t id) {
+	for (cached_inode *cached = *hash_slot(id); cached != NULL; cached = cached->hash_next) {
+		if (uuid_compare(cached->node.id, id) == 0) {
+			lru_unlink(cached);
+			lru_push(cached);
+			return cached;
+		}
+	}
+
+	return NULL;
+}
+
+static void remove_cached(cached_inode *cached) {
+	cached_inode **link = hash_slot(cached->node.id);
+
+	while (*link != cached)
+		link = &(*link)->hash_next;
+
+	*link = cached->hash_next;
+	lru_unlink(cached);
+
+	if (cached->dirty)
+		dirty_count--;
+
+	cached_count--;
+	free(cached);
+}
+
+// Drop clean inodes from the cold end until the cache fits again
+static void evict() {
+	cached_inode *cached = lru_tail;
+
+	while (cached_count > INODE_CACHE_SIZE && cached != NULL) {
+		cached_inode *previous = cached->lru_prev;
+
+		if (!cached->dirty && cached->pins == 0) {
+			remove_cached(cached);
+			evictions++;
+		}
+
+		cached = previous;
+	}
+
+	// Only writing back dirty inodes lets the cache shrink
+	if (cached_count > INODE_CACHE_SIZE && dirty_count > 0)
+		wake_flusher();
+}
+
+static cached_inode *insert(const i_node *node) {
+	cached_inode *cached = malloc(sizeof(cached_inode));
+
+	memcpy(&cached->node, node, sizeof(i_node));
+	cached->dirty = 0;
+	cached->pins = 0;
+
+	cached_inode **slot = hash_slot(node->id);
+
+	cached->hash_next = *slot;
+	*slot = cached;
+	lru_push(cached);
+	cached_count++;
+
+	return cached;
+}
+
+// Fetching an inode, from the cache if it is there
+void fetch_inode(uuid_t id, i_node *node) {
+	pthread_mutex_lock(&inode_cache_lock);
+
+	cached_inode *cached = lookup(id);
+
+	if (cached != NULL) {
+		memcpy(node, &cached->node, sizeof(i_node));
+		pthread_mutex_unlock(&inode_cache_lock);
+		return;
+	}
+
+	for (;;) {
+		unsigned long evicted = evictions;
+
+		pthread_mutex_unlock(&inode_cache_lock);
+
+		load_inode(id, node);
+
+		pthread_mutex_lock(&inode_cache_lock);
+
+		// Someone else may have cached, and changed, it in the meantime
+		cached = lookup(id);
+
+		if (cached != NULL) {
+			memcpy(node, &cached->node, sizeof(i_node));
+			break;
+		}
+
+		// Unless it was also written back and evicted again, in which
+		// case what was loaded may be older than what was written
+		if (evictions == evicted) {
+			insert(node);
+			evict();
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// Storing an inode. The store is only written when the inode is synced.
+void store_inode(i_node *node) {
+	pthread_mutex_lock(&inode_cache_lock);
+
+	cached_inode *cached = lookup(node->id);
+
+	if (cached == NULL)
+		cached = insert(node);
+	else
+		memcpy(&cached->node, node, sizeof(i_node));
+
+	if (!cached->dirty) {
+		cached->dirty = 1;
+		dirty_count++;
+	}
+
+	// Only once the new entry is dirty, so it is not the one evicted
+	evict();
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// Keep an inode in the cache while a file is open
+void pin_inode(uuid_t id) {
+	i_node node;
+	cached_inode *cached;
+
+	pthread_mutex_lock(&inode_cache_lock);
+
+	// It may be evicted again before the pin is taken
+	while ((cached = lookup(id)) == NULL) {
+		pthread_mutex_unlock(&inode_cache_lock);
+		fetch_inode(id, &node);
+		pthread_mutex_lock(&inode_cache_lock);
+	}
+
+	cached->pins++;
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+void unpin_inode(uuid_t id) {
+	pthread_mutex_lock(&inode_cache_lock);
+
+	cached_inode *cached = lookup(id);
+
+	if (cached != NULL && cached->pins > 0)
+		cached->pins--;
+
+	evict();
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+static void write_back(cached_inode *cached) {
+	save_inode(&cached->node);
+
+	cached->dirty = 0;
+	dirty_count--;
+}
+
+// Write an inode to the store if it has changed since it was last written
+void sync_inode(uuid_t id) {
+	pthread_mutex_lock(&inode_cache_lock);
+
+	cached_inode *cached = lookup(id);
+
+	if (cached != NULL && cached->dirty)
+		write_back(cached);
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// Write every changed inode to the store. The caller has paused changes.
+void write_back_inodes() {
+	pthread_mutex_lock(&inode_cache_lock);
+
+	if (dirty_count > 0)
+		write_log("Writing back %d inodes\n", dirty_count);
+
+	for (cached_inode *cached = lru_head; cached != NULL && dirty_count > 0; cached = cached->lru_next) {
+		if (cached->dirty)
+			write_back(cached);
+	}
+
+	evict();
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+// Drop an inode that is being deleted, without writing it back
+void forget_inode(uuid_t id) {
+	pthread_mutex_lock(&inode_cache_lock);
+
+	cached_inode *cached = lookup(id);
+
+	if (cached != NULL)
+		remove_cached(cached);
+
+	pthread_mutex_unlock(&inode_cache_lock);
+}
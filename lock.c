@@ -0,0 +1,233 @@
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Locks of inodes. FUSE runs operations on several threads, and each of
+// them works on copies of the inodes it fetched, so an operation locks
+// every inode it reads and changes until it has stored them again.
+//
+// An inode is locked exclusively by operations that change it as a whole,
+// or shared by those that only read it. Reads and writes of a file instead
+// lock the range of blocks they work on, which shares the inode and keeps
+// out overlapping writes. The size and block map of a file are shared by
+// every range of it, so reads and writes fetch them again, and writes
+// store them, with the map of the file locked; the blocks themselves are
+// copied with just the range locked.
+// Exclusive lockers that wait hold back new shared ones, so a busy file
+// cannot starve them.
+//
+// Locks are taken in this order, and none is taken while a later one is
+// held:
+//  1. inode locks, a directory before the entries in it
+//  2. transactions (begin_transaction), and the flush that waits for them
+//     to end (flush_all)
+//  3. map locks (lock_map), one file at a time
+//  4. the locks of the caches and tables (inode.c, buffer.c, handle.c,
+//     node.c, dentry.c, extent.c, reclaim.c), of the superblock and of
+//     the databases of the store (lock_shard), only held for short updates
+//  5. the lock of the flusher (wake_flusher)
+//
+// There is no rename, so directories form a tree and locking parents
+// before children cannot deadlock. A lock only exists while some thread
+// holds or waits for it.
+typedef struct locked_range {
+	uint64_t first; /* first and last block of the range */
+	uint64_t last;
+	int write;
+
+	struct locked_range *next;
+
+} locked_range;
+
+typedef struct inode_lock {
+	uuid_t id;
+	int users; /* threads holding or waiting for the lock */
+	int shared; /* shared holders, those of ranges included */
+	int exclusive;
+	int exclusive_waiting;
+	int map_locked;
+	locked_range *ranges;
+	pthread_cond_t changed;
+
+	struct inode_lock *next;
+
+} inode_lock;
+
+static inode_lock *inode_locks[INODE_LOCK_HASH_SIZE];
+static pthread_mutex_t inode_lock_table = PTHREAD_MUTEX_INITIALIZER;
+
+
+static inode_lock **id_slot(const uuid_t id) {
+	return &inode_locks[uuid_hash(id) % INODE_LOCK_HASH_SIZE];
+}
+
+static inode_lock *find_lock(const uuid_t id) {
+	inode_lock *lock = *id_slot(id);
+
+	while (lock != NULL && uuid_compare(lock->id, id) != 0)
+		lock = lock->next;
+
+	return lock;
+}
+
+// The lock of an inode, made if no one uses it yet
+static inode_lock *get_lock(const uuid_t id) {
+	inode_lock *lock = find_lock(id);
+
+	if (lock == NULL) {
+		lock = calloc(1, sizeof(inode_lock));
+		uuid_copy(lock->id, id);
+		pthread_cond_init(&lock->changed, NULL);
+
+		lock->next = *id_slot(id);
+		*id_slot(id) = lock;
+	}
+
+	lock->users++;
+
+	return lock;
+}
+
+static void put_lock(inode_lock *lock) {
+	pthread_cond_broadcast(&lock->changed);
+
+	if (--lock->users > 0)
+		return;
+
+	inode_lock **link = id_slot(lock->id);
+
+	while (*link != lock)
+		link = &(*link)->next;
+
+	*link = lock->next;
+
+	pthread_cond_destroy(&lock->changed);
+	free(lock);
+}
+
+static int range_conflicts(inode_lock *lock, uint64_t first, uint64_t last, int write) {
+	for (locked_range *range = lock->ranges; range != NULL; range = range->next) {
+		if (range->first <= last && first <= range->last && (write || range->write))
+			return 1;
+	}
+
+	return 0;
+}
+
+// Lock an inode for an operation that changes it
+void lock_inode(const uuid_t id) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = get_lock(id);
+
+	lock->exclusive_waiting++;
+
+	while (lock->exclusive || lock->shared > 0)
+		pthread_cond_wait(&lock->changed, &inode_lock_table);
+
+	lock->exclusive_waiting--;
+	lock->exclusive = 1;
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
+
+// Lock an inode for an operation that only reads it
+void lock_inode_shared(const uuid_t id) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = get_lock(id);
+
+	while (lock->exclusive || lock->exclusive_waiting > 0)
+		pthread_cond_wait(&lock->changed, &inode_lock_table);
+
+	lock->shared++;
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
+
+// Undo lock_inode or lock_inode_shared
+void unlock_inode(const uuid_t id) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = find_lock(id);
+
+	if (lock->exclusive)
+		lock->exclusive = 0;
+	else
+		lock->shared--;
+
+	put_lock(lock);
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
+
+// Lock the blocks first to last of a file for reading, or with write for
+// writing them
+void lock_range(const uuid_t id, uint64_t first, uint64_t last, int write) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = get_lock(id);
+
+	while (lock->exclusive || lock->exclusive_waiting > 0 || range_conflicts(lock, first, last, write))
+		pthread_cond_wait(&lock->changed, &inode_lock_table);
+
+	locked_range *range = malloc(sizeof(locked_range));
+
+	range->first = first;
+	range->last = last;
+	range->write = write;
+	range->next = lock->ranges;
+	lock->ranges = range;
+
+	lock->shared++;
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
+
+void unlock_range(const uuid_t id, uint64_t first, uint64_t last, int write) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = find_lock(id);
+	locked_range **link = &lock->ranges;
+
+	while ((*link)->first != first || (*link)->last != last || (*link)->write != write)
+		link = &(*link)->next;
+
+	locked_range *range = *link;
+
+	*link = range->next;
+	free(range);
+
+	lock->shared--;
+
+	put_lock(lock);
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
+
+// Lock the size and block map of a file while they are fetched, changed
+// and stored. Reads and writes hold a range of the file meanwhile.
+void lock_map(const uuid_t id) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = get_lock(id);
+
+	while (lock->map_locked)
+		pthread_cond_wait(&lock->changed, &inode_lock_table);
+
+	lock->map_locked = 1;
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
+
+void unlock_map(const uuid_t id) {
+	pthread_mutex_lock(&inode_lock_table);
+
+	inode_lock *lock = find_lock(id);
+
+	lock->map_locked = 0;
+
+	put_lock(lock);
+
+	pthread_mutex_unlock(&inode_lock_table);
+}
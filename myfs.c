@@ -1,936 +1,1451 @@
 #define FUSE_USE_VERSION 26
 #define ARROW "->"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <libgen.h>
+#include <stddef.h>
+#include <fuse_lowlevel.h>
 
 #include "myfs.h"
 
-// Storing root directory in memory
-i_node root_node;
+// How long, in seconds, the kernel may keep names, attributes and names
+// that do not exist. Every change goes through the kernel, which updates
+// or drops what it cached for the inodes involved, so long timeouts only
+// cost memory in the kernel.
+#define DEFAULT_ENTRY_TIMEOUT 60.0
+#define DEFAULT_ATTR_TIMEOUT 60.0
+#define DEFAULT_NEGATIVE_TIMEOUT 60.0
+
+// Inode number passed in readdir for entries the kernel has not looked up
+// yet, as the high-level API does
+#define UNKNOWN_INO 0xffffffff
+
+// Mount options understood by myfs, e.g. "-o block_size=65536"
+struct myfs_config {
+	unsigned int block_size;
+	unsigned int shards; /* databases a new store is spread over */
+	char *data_db; /* where a new store keeps its data blocks */
+	unsigned int flush_interval; /* seconds */
+	unsigned int dirty_limit; /* megabytes */
+	double entry_timeout;
+	double attr_timeout;
+	double negative_timeout; /* 0 makes the kernel ask again every time */
+};
+
+static struct myfs_config config;
+
+// Id of the root directory
+uuid_t root_id;
 
-char UUID_BUFF[100];
+// Each FUSE thread unparses into a buffer of its own
+static __thread char UUID_BUFF[37];
 
 char* get_UUID(uuid_t id)  {
 	uuid_unparse(id, UUID_BUFF);
 	return UUID_BUFF;
 }
 
-// Fetching data from the database
-void fetch_data(uuid_t data_id, void* dataStorage, size_t size) {
+// Taking exclusive use of the database a record of a set is kept in
+static unqlite *lock_set(int set, const void *key, int key_size) {
+	block_key block;
 
-	// Trying to fetch from the database
-	unqlite_int64 nBytes;
-	int rc = unqlite_kv_fetch (pDb, data_id, KEY_SIZE, NULL, &nBytes);
+	if (set == BUFFER_METADATA)
+		return lock_shard(key, key_size);
 
-	// Handling errors in case of unable to fetch
-	if (rc != UNQLITE_OK ) {
-			write_log("\nmyfs_database error - cannot fetch data\n");
-			error_handler(rc);
-	}
+	memcpy(&block, key, BLOCK_KEY_SIZE);
 
-	if (nBytes != size) {
-		write_log("myfs_database error - fetched data size different than expected");
-		exit(-1);
+	return lock_data_shard(block);
+}
+
+static void unlock_set(int set, const void *key, int key_size) {
+	block_key block;
+
+	if (set == BUFFER_METADATA) {
+		unlock_shard(key, key_size);
+		return;
 	}
 
-	// Actually fetching the data
-	rc = unqlite_kv_fetch (pDb, data_id, KEY_SIZE, dataStorage, &nBytes);
+	memcpy(&block, key, BLOCK_KEY_SIZE);
+	unlock_data_shard(block);
 }
 
-// Storing data into the database
-void store_data(uuid_t data_id, void* data, size_t size) {
-	int rc = unqlite_kv_store(pDb, data_id, KEY_SIZE, data, size);
+// Fetching a record into data, which holds *size bytes, from the buffer or
+// else from the database, and setting *size to its size. Returns 0, or
+// -ENOENT if there is no such record.
+static int find_record(int set, const void *key, int key_size, void *data, size_t *size) {
+	int rc = buffer_fetch(set, key, key_size, data, size);
+
+	if (rc != 0)
+		return rc < 0 ? rc : 0;
+
+	unqlite_int64 nBytes = *size;
 
-	// Updating the checked root
-	if (uuid_compare(data_id, root_node.id) == 0)
-		memcpy(&root_node, data, sizeof(i_node));
+	unqlite *db = lock_set(set, key, key_size);
+	rc = unqlite_kv_fetch(db, key, key_size, data, &nBytes);
+	unlock_set(set, key, key_size);
 
+	if (rc == UNQLITE_NOTFOUND)
+		return -ENOENT;
 
-	if( rc != UNQLITE_OK ) {
-		write_log("\nmyfs_create - storing of the data failed");
+	// Handling errors in case of unable to fetch
+	if (rc != UNQLITE_OK) {
+		write_log("\nmyfs_database error - cannot fetch data\n");
 		error_handler(rc);
 	}
+
+	*size = nBytes;
+
+	return 0;
+}
+
+// Fetching a record of a known size
+void fetch_record(const void *key, int key_size, void *data, size_t size) {
+	size_t nBytes = size;
+
+	if (find_record(BUFFER_METADATA, key, key_size, data, &nBytes) != 0) {
+		write_log("\nmyfs_database error - cannot fetch data\n");
+		error_handler(UNQLITE_NOTFOUND);
+	}
+
+	if (nBytes != size) {
+		write_log("myfs_database error - fetched data size different than expected");
+		exit(-1);
+	}
 }
 
-// Finding an inode of a target
-int findTargetInode(const char* path, i_node* buff) {
-	char cp_path[MAX_NAME_SIZE];
+// Fetching a record whose size is not known up front. Returns a buffer the
+// caller frees, or NULL if there is no such record.
+void *fetch_record_alloc(const void *key, int key_size, size_t *size) {
+	void *data;
+	int rc = buffer_fetch_alloc(BUFFER_METADATA, key, key_size, &data, size);
 
-	strcpy(cp_path, path);
+	if (rc != 0)
+		return rc < 0 ? NULL : data;
 
-	char* token = strtok(cp_path, "/");
+	unqlite_int64 nBytes;
 
-	i_node current_inode = root_node;
-	i_node child_inode = root_node;
+	unqlite *db = lock_shard(key, key_size);
 
-	int is_found = 0;
-	int tokenCount = 0;
+	rc = unqlite_kv_fetch(db, key, key_size, NULL, &nBytes);
 
-	// Returning root if path has no tokens
-	if (token == NULL || strcmp(path, "/") == 0) {
-		memcpy(buff, &root_node, sizeof(i_node));
-		return 0;
+	if (rc == UNQLITE_NOTFOUND) {
+		unlock_shard(key, key_size);
+		return NULL;
 	}
 
-	while (token != NULL) {
-		current_inode = child_inode;
-		dir_fcb current_fcb;
+	data = malloc(nBytes);
 
-		fetch_data(current_inode.data_id, &current_fcb, sizeof(dir_fcb));
+	if (rc == UNQLITE_OK)
+		rc = unqlite_kv_fetch(db, key, key_size, data, &nBytes);
 
-		for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
+	unlock_shard(key, key_size);
 
-			if (strcmp(current_fcb.entryNames[i], token) == 0) {
-				i_node next_inode;
+	if (rc != UNQLITE_OK) {
+		write_log("\nmyfs_database error - cannot fetch data\n");
+		error_handler(rc);
+	}
 
-				fetch_data(current_fcb.entryIds[i], &next_inode, sizeof(i_node));
+	*size = nBytes;
 
-				child_inode = next_inode;
+	return data;
+}
 
-				is_found = 1;
+// Fetching data from the database
+void fetch_data(uuid_t data_id, void* dataStorage, size_t size) {
+	fetch_record(data_id, KEY_SIZE, dataStorage, size);
+}
 
-				break;
-			}
-		}
+// Storing a record. It is written to the database by the flusher.
+void store_record(const void *key, int key_size, const void *data, size_t size) {
+	buffer_store(BUFFER_METADATA, key, key_size, data, size);
+}
 
-		tokenCount++;
+// Removing a record
+void delete_record(const void *key, int key_size) {
+	buffer_delete(BUFFER_METADATA, key, key_size);
+}
 
-		if (is_found == 0)
-			break;
+// Storing data into the database
+void store_data(uuid_t data_id, void* data, size_t size) {
+	store_record(data_id, KEY_SIZE, data, size);
+}
 
-		token = strtok(NULL, "/");
-	}
+// Fetching an inode, bypassing the inode cache. Inodes of inline files are
+// longer than the fixed fields, so the record is fetched in one go into
+// the largest possible inode.
+void load_inode(uuid_t id, i_node *node) {
+	size_t nBytes = sizeof(i_node);
 
-	// When token is 1, current inode is root
-	if (is_found == 1 || tokenCount == 1) {
-			memcpy(buff, &child_inode, sizeof(i_node));
-			return 0;
+	if (find_record(BUFFER_METADATA, id, KEY_SIZE, node, &nBytes) != 0) {
+		write_log("\nmyfs_database error - cannot fetch inode\n");
+		error_handler(UNQLITE_NOTFOUND);
 	}
-	else {
-		return -1;
+
+	if (nBytes < INODE_HEADER_SIZE) {
+		write_log("myfs_database error - fetched inode is too short");
+		exit(-1);
 	}
+
+	// Inline data past the end of the file reads as zeros
+	memset((uint8_t *) node + nBytes, 0, sizeof(i_node) - nBytes);
 }
 
+// Storing an inode, with the data of inline files, bypassing the inode cache
+void save_inode(const i_node *node) {
+	size_t size = INODE_HEADER_SIZE;
 
-// Get file and directory attributes (meta-data)
-static int myfs_getattr(const char *path, struct stat *stbuf) {
-	write_log("\nmyfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+	if (node->flags & INODE_INLINE)
+		size += node->size;
 
-	memset(stbuf, 0, sizeof(struct stat));
+	store_record(node->id, KEY_SIZE, node, size);
+}
 
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = root_node.mode;
-		stbuf->st_nlink = 2;
-		stbuf->st_uid = root_node.uid;
-		stbuf->st_gid = root_node.gid;
-		stbuf->st_ctime = root_node.ctime;
-		stbuf->st_atime = root_node.atime;
-		stbuf->st_mtime = root_node.mtime;
-		stbuf->st_size = root_node.size;
+// Fetching a data block. Returns 0, or -EIO if a block the caller found
+// mapped is missing from the store.
+int fetch_block(const block_key *key, void *data) {
+	size_t nBytes = BLOCK_SIZE;
 
-		return 0;
+	if (find_record(BUFFER_DATA, key, BLOCK_KEY_SIZE, data, &nBytes) != 0) {
+		write_log("myfs_database error - block %llu is mapped but missing\n", (unsigned long long) *key);
+		return -EIO;
 	}
-	else {
-		i_node parent;
 
+	if (nBytes != BLOCK_SIZE) {
+		write_log("myfs_database error - fetched block size different than expected");
+		exit(-1);
+	}
 
+	return 0;
+}
 
-		char *target_name;
-		char path_cp[strlen(path) + 1];
-		char path_cp2[strlen(path) + 1];
+// Storing a data block. It is written to the databases of the data by the
+// flusher.
+void store_block(const block_key *key, const void *data) {
+	buffer_store(BUFFER_DATA, key, BLOCK_KEY_SIZE, data, BLOCK_SIZE);
+}
 
-		strcpy(path_cp, path);
-		strcpy(path_cp2, path);
+// Removing a data block
+void delete_block(const block_key *key) {
+	buffer_delete(BUFFER_DATA, key, BLOCK_KEY_SIZE);
+}
 
-		target_name = basename(path_cp);
+// Fetching the inode behind an inode number the kernel passed in
+static int fetch_node(fuse_ino_t ino, i_node *node) {
+	uuid_t id;
 
-		char *parentPath;
-		parentPath = dirname(path_cp2);
+	if (node_id(ino, id) != 0)
+		return -ENOENT;
 
+	fetch_inode(id, node);
+	return 0;
+}
 
+// Locking the inode behind an inode number and fetching it, for operations
+// that change it or depend on it staying the same. Operations that only
+// read it lock it shared. It is unlocked with unlock_inode.
+static int lock_node(fuse_ino_t ino, i_node *node, int shared) {
+	uuid_t id;
 
-		int found = findTargetInode(parentPath, &parent);
+	if (node_id(ino, id) != 0)
+		return -ENOENT;
 
-		if (found == -1)
-			return -ENOENT;
+	if (shared)
+		lock_inode_shared(id);
+	else
+		lock_inode(id);
 
-		dir_fcb parent_dir_fcb;
+	fetch_inode(id, node);
+	return 0;
+}
 
-		fetch_data(parent.data_id, &parent_dir_fcb, sizeof(dir_fcb));
+// Finding the inode called name in a directory. Names are resolved through
+// the dentry cache first, which also remembers names that do not exist.
+static int lookup_child(i_node *parent, const char *name, i_node *child) {
+	uuid_t child_id;
+	int rc = dentry_lookup(parent->id, name, child_id);
 
-		for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
+	if (rc == -ENOENT)
+		return -ENOENT;
 
-			if (strcmp(parent_dir_fcb.entryNames[i], "") != 0) {
-				write_log("\ngetAttr -> found entry in fcb parent with name: %s", parent_dir_fcb.entryNames[i]);
+	if (rc != 0) {
+		if (dir_lookup(parent->data_id, name, child_id) != 0) {
+			dentry_insert(parent->id, name, NULL);
+			return -ENOENT;
+		}
 
+		dentry_insert(parent->id, name, child_id);
+	}
 
-				if (strcmp(parent_dir_fcb.entryNames[i], target_name) == 0) {
-					i_node current;
+	fetch_inode(child_id, child);
+	return 0;
+}
 
-					fetch_data(parent_dir_fcb.entryIds[i], &current, sizeof(i_node));
+// Attributes of an inode as they are handed to the kernel
+static void fill_stat(fuse_ino_t ino, const i_node *node, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
 
-					stbuf->st_mode = current.mode;
-					stbuf->st_nlink = 2;
-					stbuf->st_uid = current.uid;
-					stbuf->st_gid = current.gid;
-					stbuf->st_ctime = current.ctime;
-					stbuf->st_atime = current.atime;
-					stbuf->st_mtime = current.mtime;
-					stbuf->st_size = current.size;
+	stbuf->st_ino = ino;
+	stbuf->st_mode = node->mode;
+	stbuf->st_nlink = 2;
+	stbuf->st_uid = node->uid;
+	stbuf->st_gid = node->gid;
+	stbuf->st_ctime = node->ctime;
+	stbuf->st_atime = node->atime;
+	stbuf->st_mtime = node->mtime;
+	stbuf->st_size = node->size;
+	stbuf->st_blocks = (node->flags & INODE_INLINE) ? (node->size + 511) / 512 : node->blocks * (BLOCK_SIZE / 512);
+}
 
-					return 0;
-				}
-			}
-		}
+// Answering lookup, mkdir and create (when fi is set). Every entry handed
+// to the kernel is a lookup reference it gives back with forget.
+static void reply_entry(fuse_req_t req, const i_node *node, struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
 
-		write_log("\ngetAttr -> directory not found\n", path, stbuf);
+	memset(&e, 0, sizeof(e));
+	e.ino = node_get(node->id);
+	e.attr_timeout = config.attr_timeout;
+	e.entry_timeout = config.entry_timeout;
 
-		return -ENOENT;
+	fill_stat(e.ino, node, &e.attr);
+
+	if (fi != NULL)
+		fuse_reply_create(req, &e, fi);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+// Answering a lookup of a name that does not exist. An entry with inode
+// number 0 lets the kernel remember that for negative_timeout.
+static void reply_negative(fuse_req_t req) {
+	struct fuse_entry_param e;
+
+	if (config.negative_timeout <= 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
+
+	memset(&e, 0, sizeof(e));
+	e.entry_timeout = config.negative_timeout;
+
+	fuse_reply_entry(req, &e);
 }
 
-// Read a directory.
-static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
-	(void) offset;
-	(void) fi;
+// Look up a directory entry by name and get its attributes
+static void myfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	write_log("\nmyfs_lookup(parent=%lu, name=\"%s\")\n", parent, name);
 
-	write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+	i_node parent_node;
+	i_node child;
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	// Keeps the directory from changing between resolving the name and
+	// caching the result
+	if (lock_node(parent, &parent_node, 1) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	// Finding the parent
-	i_node parent;
+	if (!S_ISDIR(parent_node.mode)) {
+		unlock_inode(parent_node.id);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
 
-	findTargetInode(path, &parent);
+	if (lookup_child(&parent_node, name, &child) != 0) {
+		unlock_inode(parent_node.id);
+		write_log("\nmyfs_lookup -> not found\n");
+		reply_negative(req);
+		return;
+	}
 
+	unlock_inode(parent_node.id);
 
-	dir_fcb parent_dir_fcb;
+	reply_entry(req, &child, NULL);
+}
 
-	fetch_data(parent.data_id, &parent_dir_fcb, sizeof(dir_fcb));
+// Drop nlookup of the references lookup handed to the kernel
+static void myfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	write_log("myfs_forget(ino=%lu, nlookup=%lu)\n", ino, nlookup);
 
-	write_log("\ngetAttr -> current dir name: %s", parent_dir_fcb.entryNames[0]);
+	node_forget(ino, nlookup);
 
-	for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
-		if (strncmp(parent_dir_fcb.entryNames[i], "", MAX_NAME_SIZE) != 0) {
-			filler(buf, parent_dir_fcb.entryNames[i], NULL, 0);
-		}
+	fuse_reply_none(req);
+}
 
+// Get file and directory attributes (meta-data)
+static void myfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	write_log("\nmyfs_getattr(ino=%lu, fi=0x%08x)\n", ino, fi);
+
+	i_node current;
+	struct stat stbuf;
 
+	if (fetch_node(ino, &current) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
 	}
 
-	return 0;
+	fill_stat(ino, &current, &stbuf);
+
+	fuse_reply_attr(req, &stbuf, config.attr_timeout);
 }
 
-int read_single_block(uuid_t block_id, char* buf, size_t size) {
-	data_block block;
-	fetch_data(block_id, &block, sizeof(data_block));
+// Reply to readdir being put together. The offset of an entry tells where
+// the listing goes on after it: 1 and 2 come after "." and "..", and
+// READDIR_DOTS + p + 1 after the directory entry at position p. Entries
+// never move, so these stay valid while the directory changes and a
+// listing is picked up where it stopped without walking the pages before.
+#define READDIR_DOTS 2
+
+struct readdir_state {
+	fuse_req_t req;
+	uuid_t dir; /* inode id of the directory */
+	char *buf;
+	size_t size;
+	size_t used;
+};
+
+// Add an entry with the attributes in st, followed by the listing from
+// next on. Returns 1 once the reply is full.
+static int add_direntry(struct readdir_state *state, const char *name, struct stat *st, off_t next) {
+	size_t needed = fuse_add_direntry(state->req, NULL, 0, name, NULL, 0);
 
-	int read_size = size;
+	if (state->used + needed > state->size)
+		return 1;
 
-	if (size > MAX_BLOCK_SIZE)
-		read_size = MAX_BLOCK_SIZE;
+	fuse_add_direntry(state->req, state->buf + state->used, state->size - state->used, name, st, next);
+	state->used += needed;
 
-	memcpy(buf, &block.data, read_size);
+	return 0;
+}
 
-	write_log("Data read: %s\n", block.data);
+// The kernel only takes the inode number and type of an entry from
+// readdir, both known without fetching its inode
+static int fill_entry(const char *name, uuid_t id, uint8_t type, uint64_t position, void *arg) {
+	struct readdir_state *state = arg;
+	struct stat st;
 
-	return read_size;
+	// The lookups that usually follow a listing find the names cached
+	dentry_insert(state->dir, name, id);
 
-}
+	memset(&st, 0, sizeof(struct stat));
+	st.st_ino = node_peek(id);
+	st.st_mode = DTTOIF(type);
 
+	if (st.st_ino == 0)
+		st.st_ino = UNKNOWN_INO;
 
-int read_single_indirect_blocks(uuid_t id, char* buf, size_t size, off_t offset) {
-	single_indirect indirect_blocks;
+	return add_direntry(state, name, &st, READDIR_DOTS + position + 1);
+}
 
-	fetch_data(id, &indirect_blocks, sizeof(single_indirect));
+// Read a directory
+static void myfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	write_log("myfs_readdir(ino=%lu, size=%d, offset=%lld, fi=0x%08x)\n", ino, size, offset, fi);
 
-	int read_in_total = 0;
-	int data_available = size;
+	i_node parent;
 
-	write_log("Reading indirect blocks... ");
+	// Locked like for lookup, as entries go into the dentry cache
+	if (lock_node(ino, &parent, 1) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	for (int i = 0; i < FIRST_INDIRECT_ENTRY_NUMBER; i++) {
-		if (data_available > 0) {
+	if (!S_ISDIR(parent.mode)) {
+		unlock_inode(parent.id);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
 
-			write_log("Reading indirect block : %d\n", i);
-			int read = read_single_block(indirect_blocks.blocks[i], buf + read_in_total, size);
+	struct readdir_state state = { req };
+	struct stat st;
+	int full = 0;
 
-			write_log("Indirect block read: %d\n", i);
+	uuid_copy(state.dir, parent.id);
+	state.size = size;
+	state.buf = malloc(size);
 
-			data_available -= read;
-			read_in_total += read;
+	if (offset < 1) {
+		fill_stat(ino, &parent, &st);
+		full = add_direntry(&state, ".", &st, 1);
+	}
 
-		}
-		else {
-			write_log("Last read log: %d", i);
-			break;
-		}
+	if (offset < 2 && !full) {
+		// The parent is not known here
+		memset(&st, 0, sizeof(struct stat));
+		st.st_ino = UNKNOWN_INO;
+		st.st_mode = S_IFDIR;
 
-		if (read_in_total >= size)
-			break;
+		full = add_direntry(&state, "..", &st, 2);
 	}
 
+	if (!full)
+		dir_iterate(parent.data_id, offset > READDIR_DOTS ? offset - READDIR_DOTS : 0, fill_entry, &state);
 
-	return read_in_total;
-}
+	unlock_inode(parent.id);
 
-// Read a file.
-static int myfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	(void) fi;
+	fuse_reply_buf(req, state.buf, state.used);
 
-	write_log("\nmyfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+	free(state.buf);
+}
 
-	i_node target;
+// Bounce buffer for partial blocks, aligned so memcpy can use wide stores
+static uint8_t *alloc_block() {
+	void *block;
 
-	if (findTargetInode(path, &target) != 0) {
-		write_log("Failed to fetch the target...\n");
+	if (posix_memalign(&block, BLOCK_ALIGNMENT, BLOCK_SIZE) != 0) {
+		write_log("myfs - cannot allocate a block buffer\n");
+		exit(-1);
 	}
 
-	findTargetInode(path, &target);
+	return block;
+}
 
-	fcb target_fcb;
+// Read size bytes starting at offset within a single block. Returns the
+// number of bytes read or an error.
+int read_single_block(const block_key *key, char* buf, off_t offset, size_t size) {
+	// Whole blocks are fetched straight into the caller's buffer
+	if (offset == 0 && size >= BLOCK_SIZE) {
+		int rc = fetch_block(key, buf);
 
-	write_log("Reading the file... \n");
+		return rc < 0 ? rc : BLOCK_SIZE;
+	}
 
-	fetch_data(target.data_id, &target_fcb, sizeof(target_fcb));
+	uint8_t *block = alloc_block();
 
+	if (offset + size > BLOCK_SIZE)
+		size = BLOCK_SIZE - offset;
 
+	int rc = fetch_block(key, block);
 
-	int read_in_total = 0;
-	int data_available = target.size;
+	if (rc == 0)
+		memcpy(buf, block + offset, size);
 
-	for (int i = 0; i < MAX_BLOCK_NUMBER; i++) {
+	free(block);
 
-		if (data_available > 0) {
+	return rc < 0 ? rc : (int) size;
+}
 
-			write_log("Reading block: %d\n", i);
-			int read = read_single_block(target_fcb.direct_blocks[i], buf + read_in_total, size);
+// Work out the keys of every block in [first, first + count), 0 for the
+// blocks of holes
+static void map_read_blocks(fcb *map, uint32_t first, uint32_t count, block_key *keys) {
+	// Extent of the previous block, so the tree is only searched once per extent
+	extent current;
+	int mapped = 0;
 
-			write_log("Block read: %d\n", i);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t block = first + i;
 
-			data_available -= read;
-			read_in_total += read;
+		if (!mapped || block >= current.file_block + current.length)
+			mapped = extent_lookup(map, block, &current);
 
-		}
+		// Block number 0 is never handed out
+		if (mapped)
+			extent_block_key(&current, block, &keys[i]);
 		else
-			break;
+			keys[i] = 0;
+	}
+}
 
+// Read size bytes of a file from offset into buf. Returns the number of
+// bytes read or an error.
+static int read_file(i_node *target, char *buf, size_t size, off_t offset) {
+	// Writes to other ranges of the file change its size and block map,
+	// so both are looked up with the map locked
+	lock_map(target->id);
 
+	fetch_inode(target->id, target);
 
-		if (read_in_total >= size)
-			break;
+	if (offset >= target->size || size == 0) {
+		unlock_map(target->id);
+		return 0;
 	}
 
-	if (read_in_total < size && data_available > 0)
-		read_in_total += read_single_indirect_blocks(target_fcb.single_indirect_blocks, buf + read_in_total, data_available, offset);
+	if (offset + size > target->size)
+		size = target->size - offset;
 
+	if (target->flags & INODE_INLINE) {
+		memcpy(buf, target->inline_data + offset, size);
+		unlock_map(target->id);
 
-	return read_in_total;
-}
+		return size;
+	}
 
-static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi){
-    write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
+	fcb target_fcb;
 
-	int pathlen = strlen(path);
+	write_log("Reading the file... \n");
 
-	if (pathlen >= MAX_NAME_SIZE) {
-		write_log("myfs_create - ENAMETOOLONG");
-		return -ENAMETOOLONG;
+	fetch_map(target, &target_fcb);
+
+	// Only the blocks in [offset, offset + size) are visited
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+	block_key *keys = malloc(count * sizeof(block_key));
+
+	map_read_blocks(&target_fcb, first, count, keys);
+
+	unlock_map(target->id);
+
+	// The blocks themselves stay as they are while the range is locked
+	int read_in_total = 0;
+	int data_available = size;
+	int relative_offset = offset % BLOCK_SIZE;
+
+	for (uint32_t i = 0; i < count; i++) {
+		int read;
+
+		write_log("Reading block: %d\n", first + i);
+
+		if (keys[i] != 0) {
+			read = read_single_block(&keys[i], buf + read_in_total, relative_offset, data_available);
+
+			// What was read up to the missing block is still returned
+			if (read < 0) {
+				free(keys);
+				return read_in_total > 0 ? read_in_total : read;
+			}
+		}
+		else {
+			// Blocks that were never written read back as zeros
+			read = BLOCK_SIZE - relative_offset;
+
+			if (read > data_available)
+				read = data_available;
+
+			memset(buf + read_in_total, 0, read);
+		}
+
+		data_available -= read;
+		read_in_total += read;
+		relative_offset = 0;
 	}
 
+	free(keys);
 
+	return read_in_total;
+}
 
-	write_log("myfs_create: path - %s\n", path);
+// Blocks of a file a read or write of size bytes at offset works on
+static void block_range(off_t offset, size_t size, uint64_t *first, uint64_t *last) {
+	*first = offset / BLOCK_SIZE;
+	*last = (offset + (size > 0 ? size : 1) - 1) / BLOCK_SIZE;
+}
 
-	// Getting the inode of the parent
-	i_node parent;
+// Read a file.
+static void myfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+	write_log("\nmyfs_read(ino=%lu, size=%d, offset=%lld, fi=0x%08x)\n", ino, size, offset, fi);
 
-	findTargetInode(path, &parent);
+	// The handle of the open file leads straight to its inode
+	i_node target;
+	uuid_t id;
+	uint64_t first, last;
 
-	// Fetching the dir fcb of the parent
-	dir_fcb parent_fcb;
+	handle_id(fi->fh, id);
+	block_range(offset, size, &first, &last);
 
-	fetch_data(parent.data_id, &parent_fcb, sizeof(dir_fcb));
+	// Reads only wait for writes to the same blocks and for truncates
+	lock_range(id, first, last, 0);
+	fetch_inode(id, &target);
 
-	// Getting the name of the file
-	char *file_name;
-	char path_cp[strlen(path) + 1];
+	char *buf = malloc(size);
+	int read = read_file(&target, buf, size, offset);
 
-	strcpy(path_cp, path);
+	unlock_range(id, first, last, 0);
 
-	file_name = basename(path_cp);
+	if (read < 0)
+		fuse_reply_err(req, -read);
+	else
+		fuse_reply_buf(req, buf, read);
 
+	free(buf);
+}
 
-	for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
-		if (strcmp("", parent_fcb.entryNames[i]) == 0) {
-			//Creating a new file and storing it in the parent's fcb
-			i_node new_file;
+// Create and open a file
+static void myfs_create(fuse_req_t req, fuse_ino_t parent_ino, const char *name, mode_t mode, struct fuse_file_info *fi){
+    write_log("myfs_create(parent=%lu, name=\"%s\", mode=0%03o, fi=0x%08x)\n", parent_ino, name, mode, fi);
 
-			uuid_generate(new_file.id);
+	if (strlen(name) >= MAX_NAME_SIZE) {
+		write_log("myfs_create - ENAMETOOLONG");
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
 
-			strcpy(parent_fcb.entryNames[i], file_name);
-			uuid_copy(parent_fcb.entryIds[i], new_file.id);
+	// Getting the inode of the parent
+	i_node parent;
 
-			fcb new_file_fcb;
+	if (lock_node(parent_ino, &parent, 0) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-			memset(&new_file_fcb, 0, sizeof(new_file_fcb));
+	//Creating a new file and storing it in the parent's directory
+	i_node new_file;
 
-			uuid_generate(new_file.data_id);
+	memset(&new_file, 0, sizeof(i_node));
 
-			store_data(new_file.data_id, &new_file_fcb, sizeof(new_file_fcb));
+	uuid_generate(new_file.id);
 
-			write_log("\nmyfs_create: file entry has been found and occupied\n");
+	// New files start inline, the fcb is only made once they outgrow the inode
+	new_file.flags = INODE_INLINE;
 
-			write_log("\nmyfs_create: name of the file:  (%s) \n", &parent_fcb.entryNames[i]);
+	write_log("\nmyfs_create: name of the file:  (%s) \n", name);
 
-			struct fuse_context *context = fuse_get_context();
+	const struct fuse_ctx *context = fuse_req_ctx(req);
 
-			time_t current_time = time(NULL);
-			new_file.uid = context->uid;
-			new_file.gid = context->gid;
-			new_file.mode = mode | S_IFREG;
-			new_file.atime = current_time;
-			new_file.ctime = current_time;
-			new_file.mtime = current_time;
-			new_file.size = 0;
+	time_t current_time = time(NULL);
+	new_file.uid = context->uid;
+	new_file.gid = context->gid;
+	new_file.mode = mode | S_IFREG;
+	new_file.atime = current_time;
+	new_file.ctime = current_time;
+	new_file.mtime = current_time;
+	new_file.size = 0;
 
-			parent.size++;
-			parent.mtime = current_time;
+	// The inode and the entry pointing at it are written together
+	begin_transaction();
 
-			store_data(parent.id, &parent, sizeof(i_node));
+	store_inode(&new_file);
 
-			// Storing the file's inode in the database
-			store_data(new_file.id, &new_file, sizeof(i_node));
+	int rc = dir_add(parent.data_id, name, new_file.id, new_file.mode);
 
-			store_data(parent_fcb.id, &parent_fcb, sizeof(dir_fcb));
+	if (rc != 0) {
+		// Nothing points at the new inode, so it goes again
+		forget_inode(new_file.id);
+		delete_record(new_file.id, KEY_SIZE);
 
-			break;
-		}
+		commit_transaction();
+		unlock_inode(parent.id);
+
+		fuse_reply_err(req, -rc);
+		return;
 	}
 
-	write_log("\nmyfs_create: file created succesfully\n");
+	parent.size++;
+	parent.mtime = current_time;
 
+	store_inode(&parent);
 
-    return 0;
-}
+	commit_transaction();
 
-// Set update the times (actime, modtime) for a file
-static int myfs_utime(const char *path, struct utimbuf *ubuf){
-    write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+	dentry_invalidate(parent.id, name);
 
+	unlock_inode(parent.id);
 
-    i_node current;
+	write_log("\nmyfs_create: file created succesfully\n");
 
-    findTargetInode(path, &current);
+	fi->fh = handle_open(new_file.id);
 
-    current.mtime = ubuf->modtime;
-    current.atime = ubuf->actime;
+	reply_entry(req, &new_file, fi);
+}
 
-	store_data(current.id, &current, sizeof(i_node));
+// Write data to a single block. Blocks the write covers completely are
+// stored straight from the caller's buffer, only the partial head and tail
+// blocks are fetched and patched. Returns the number of bytes written or
+// an error.
+int write_to_block(off_t offset, const block_key *key, const char *data, size_t size, int new_block) {
+	if (offset == 0 && size >= BLOCK_SIZE) {
+		store_block(key, data);
+		return BLOCK_SIZE;
+	}
 
-    return 0;
-}
+	uint8_t *block = alloc_block();
 
+	int to_write = size;
 
-// Write data to a single block
-int write_to_block(off_t offset, uuid_t block_id, const char *data, size_t size, int new_block) {
-	data_block block;
+	if (offset + size > BLOCK_SIZE)
+		to_write = BLOCK_SIZE - offset;
 
 	if (new_block == 1){
 		write_log("Block was generated.\n");
-		memset(&block, 0, sizeof(data_block));
+		memset(block, 0, BLOCK_SIZE);
 	}
 	else {
 		write_log("Block was fetched from the database.\n");
-		fetch_data(block_id, &block, sizeof(data_block));
-	}
 
-	int to_write = size;
-	int written = size;
-
-	if (size >= MAX_BLOCK_SIZE)
-		to_write = MAX_BLOCK_SIZE;
+		int rc = fetch_block(key, block);
 
-	if (offset + size > MAX_BLOCK_SIZE)
-		written = MAX_BLOCK_SIZE - offset;
+		if (rc < 0) {
+			free(block);
+			return rc;
+		}
+	}
 
-	write_log("Writing to a new block... \n");
 	write_log("To write: %d\n", to_write);
-	write_log("Writable size:%d\n", to_write);
 
-	snprintf(block.data + offset, to_write + 1, data);
+	memcpy(block + offset, data, to_write);
 
-	write_log("Data written: %.4s\n", data);
-	write_log("Written to a new block: %d bytes\n", written);
+	store_block(key, block);
 
-	store_data(block_id, &block, sizeof(data_block));
+	free(block);
 
-	return written;
+	return to_write;
 }
 
-// Write data to first indirect blocks
-int write_to_indirect_blocks(uuid_t id, size_t size, const char* data, off_t offset, int new_block) {
-	single_indirect indirect_blocks;
+// Move the data of an inline file into its first block and give it an
+// extent tree. The caller stores the inode and the fcb.
+static void uninline_file(i_node *node, fcb *map) {
+	memset(map, 0, sizeof(fcb));
+	uuid_generate(node->data_id);
 
-	write_log("Writting data to single indirect blocks... \n");
+	if (node->size > 0) {
+		extent first;
+		block_key key;
+		uint8_t *block = alloc_block();
 
-	if (new_block == 1)
-		memset(&indirect_blocks, 0, sizeof(single_indirect));
-	else
-		fetch_data(id, &indirect_blocks, sizeof(single_indirect));
+		memset(block, 0, BLOCK_SIZE);
+		memcpy(block, node->inline_data, node->size);
 
+		extent_map_blocks(map, 0, 1, &first);
+		extent_block_key(&first, 0, &key);
+		store_block(&key, block);
 
+		free(block);
 
+		node->blocks = 1;
+		account_space(BLOCK_SIZE, 0);
+	}
 
-	int start_index = (offset / MAX_BLOCK_SIZE);
+	node->flags &= ~INODE_INLINE;
+	memset(node->inline_data, 0, INLINE_DATA_SIZE);
 
-	int written_in_total = 0;
+	write_log("File data moved out of its inode\n");
+}
 
-	int relative_offset = offset - ((offset / MAX_BLOCK_SIZE) * MAX_BLOCK_SIZE);
+// Work out the keys of every block in [first, first + count), mapping the
+// ones that do not exist yet. Returns how many blocks could be mapped, or
+// an error if not even the first one could.
+static int map_write_blocks(fcb *map, uint32_t first, uint32_t count, block_key *keys, uint8_t *new_blocks) {
+	// Extent of the previous block, so the tree is only searched once per extent
+	extent current;
+	int mapped = 0;
+	uint32_t i = 0;
+
+	while (i < count) {
+		uint32_t block = first + i;
+
+		if (!mapped || block >= current.file_block + current.length)
+			mapped = extent_lookup(map, block, &current);
+
+		if (mapped) {
+			extent_block_key(&current, block, &keys[i]);
+			new_blocks[i] = 0;
+			i++;
+			continue;
+		}
 
-	if (offset % MAX_BLOCK_SIZE == 0)
-		relative_offset = 0;
+		int rc = extent_map_blocks(map, block, count - i, &current);
 
-	write_log("Writting data to single indirect blocks... \n");
+		if (rc < 0)
+			return i > 0 ? (int) i : rc;
 
+		for (int j = 0; j < rc; j++) {
+			extent_block_key(&current, block + j, &keys[i + j]);
+			new_blocks[i + j] = 1;
+		}
 
-	for (int i = start_index; i < FIRST_INDIRECT_ENTRY_NUMBER; i++) {
+		i += rc;
+		mapped = 1;
+	}
 
-		write_log("Writting to indirect block: %d\n", i);
+	return count;
+}
 
-		if (i != start_index)
-			relative_offset = 0;
+// Write size bytes from buf into a file at offset. Returns the number of
+// bytes written or an error.
+static int write_file(i_node *target, const char *buf, size_t size, off_t offset) {
+	if (offset + size > MAX_FILE_SIZE){
+		write_log("myfs_write - EFBIG");
+		return -EFBIG;
+	}
 
-		int size_to_write = size - written_in_total;
+	if (size == 0)
+		return 0;
 
-		int written = 0;
-		if (uuid_compare(zero_uuid, indirect_blocks.blocks[i]) == 0) {
-			uuid_generate(indirect_blocks.blocks[i]);
-			written = write_to_block(relative_offset, indirect_blocks.blocks[i], data, size_to_write, 1);
-		}
-		else
-			written = write_to_block(relative_offset, indirect_blocks.blocks[i], data, size_to_write, 0);
+	// The blocks of the write are flushed together with its block map
+	begin_transaction();
 
+	// Writes to other ranges of the file may have changed its size and
+	// block map since it was fetched, so both are fetched again with the
+	// map locked. Only the blocks are written with just the range locked.
+	lock_map(target->id);
 
+	fetch_inode(target->id, target);
 
-		written_in_total += written;
+	// Small files are written within their inode record
+	if ((target->flags & INODE_INLINE) && offset + size <= INLINE_DATA_SIZE) {
+		memcpy(target->inline_data + offset, buf, size);
 
-		data += written;
+		if (offset + size > target->size)
+			target->size = offset + size;
 
-		if (written_in_total >= size) {
-			write_log("Last written log: %d", i);
-			break;
-		}
+		store_inode(target);
 
+		unlock_map(target->id);
+		commit_transaction();
 
+		return size;
 	}
 
-	store_data(id, &indirect_blocks, sizeof(single_indirect));
+	write_log("Writting to file... \n");
 
-	return written_in_total;
-}
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t count = (offset + size - 1) / BLOCK_SIZE - first + 1;
+	int relative_offset = offset % BLOCK_SIZE;
 
+	block_key *keys = malloc(count * sizeof(block_key));
+	uint8_t *new_blocks = malloc(count);
 
-// Write to a file.
-// Read 'man 2 write'
-static int myfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-    write_log("\nmyfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+	fcb target_fcb;
+	int was_inline = target->flags & INODE_INLINE;
 
-	if (size >= MAX_FILE_SIZE){
-		write_log("myfs_write - EFBIG");
-		return -EFBIG;
-	}
+	if (was_inline)
+		uninline_file(target, &target_fcb);
+	else
+		fetch_map(target, &target_fcb);
 
-	// Getting the inode of the file
-	i_node target;
+	int mapped = map_write_blocks(&target_fcb, first, count, keys, new_blocks);
+	uint64_t allocated = 0;
 
-	findTargetInode(path, &target);
+	for (int i = 0; i < mapped; i++)
+		allocated += new_blocks[i];
 
-	fcb target_fcb;
+	if (allocated > 0) {
+		target->blocks += allocated;
+		account_space(allocated * BLOCK_SIZE, 0);
+	}
+
+	// The data of an inline file has been moved out even if nothing could
+	// be mapped
+	if (was_inline || allocated > 0) {
+		store_map(target, &target_fcb);
+		store_inode(target);
+	}
 
-	fetch_data(target.data_id, &target_fcb, sizeof(fcb));
+	unlock_map(target->id);
 
-	write_log("Writting to file... \n");
+	if (mapped < 0) {
+		commit_transaction();
+		free(keys);
+		free(new_blocks);
+		return mapped;
+	}
 
-	int initial_offset = offset;
+	// Only part of the write fits into the block map
+	if ((uint32_t) mapped < count)
+		size = mapped * BLOCK_SIZE - relative_offset;
 
 	int written_in_total = 0;
+	int error = 0;
 
-	if (offset / MAX_BLOCK_SIZE < MAX_BLOCK_NUMBER) {
-		int start_index = (offset / MAX_BLOCK_SIZE);
-		int relative_offset = offset - ((offset / MAX_BLOCK_SIZE) * MAX_BLOCK_SIZE);
+	for (int i = 0; i < mapped; i++) {
+		if (error == 0) {
+			int written = write_to_block(relative_offset, &keys[i], buf, size - written_in_total, new_blocks[i]);
 
-		if (offset % MAX_BLOCK_SIZE == 0)
-			relative_offset = 0;
+			if (written >= 0) {
+				written_in_total += written;
+				buf += written;
+				relative_offset = 0;
+				continue;
+			}
 
-		for (int i = start_index; i < MAX_BLOCK_NUMBER; i++) {
+			error = written;
+		}
 
-				if (i != start_index)
-					relative_offset = 0;
+		// The write stops short, but the blocks mapped for it must exist
+		if (new_blocks[i])
+			write_to_block(0, &keys[i], buf, 0, 1);
+	}
 
-	            write_log("Printing size: %d\n", size);
-	            write_log("Block number: %d\n", i);
-	            write_log("Relative offset: %d\n", relative_offset);
+	// Writes further on may have grown the file meanwhile
+	if (written_in_total > 0) {
+		lock_map(target->id);
 
-	            int size_to_write = size - written_in_total;
+		fetch_inode(target->id, target);
 
-				int written = 0;
+		if (offset + written_in_total > target->size) {
+			target->size = offset + written_in_total;
+			store_inode(target);
+		}
 
-				//Checking if the block already exists or not
-	            if (uuid_compare(zero_uuid, target_fcb.direct_blocks[i]) == 0) {
-	            	uuid_generate(target_fcb.direct_blocks[i]);
-					written = write_to_block(relative_offset, target_fcb.direct_blocks[i], buf, size_to_write, 1);
-				}
-				else
-					written = write_to_block(relative_offset, target_fcb.direct_blocks[i], buf, size_to_write, 0);
+		unlock_map(target->id);
+	}
 
-				written_in_total += written;
+	commit_transaction();
 
-				write_log("Printing size after written: %d\n", size);
-				write_log("Written in total so far:: %d\n", written_in_total);
+	free(keys);
+	free(new_blocks);
 
-				buf += written;
+	throttle_buffer();
 
-				if (written_in_total >= size)
-					break;
+	write_log("Written in total: %d\n", written_in_total);
 
-		}
+	if (written_in_total == 0 && error < 0)
+		return error;
 
-		// In case all direct blocks are filled
-		if (written_in_total < size) {
-		  if (uuid_compare(zero_uuid, target_fcb.single_indirect_blocks) == 0) {
-          		uuid_generate(target_fcb.single_indirect_blocks);
-          		written_in_total += write_to_indirect_blocks(target_fcb.single_indirect_blocks, size - written_in_total, buf, 0, 1);
-		  }
-		  else
-				written_in_total += write_to_indirect_blocks(target_fcb.single_indirect_blocks, size - written_in_total, buf, 0, 0);
+	return written_in_total;
+}
 
-		}
+// Write to a file.
+// Read 'man 2 write'
+static void myfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+    write_log("\nmyfs_write(ino=%lu, buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", ino, buf, size, offset, fi);
 
-	}
+	// Getting the inode of the file
+	i_node target;
+	uuid_t id;
 
-	// If offset exceeds the direct block storage capacity
-	else {
-		offset -= MAX_BLOCK_SIZE * MAX_BLOCK_NUMBER;
-
-		 if (uuid_compare(zero_uuid, target_fcb.single_indirect_blocks) == 0) {
-          		uuid_generate(target_fcb.single_indirect_blocks);
-          		written_in_total += write_to_indirect_blocks(target_fcb.single_indirect_blocks, size, buf, offset, 1);
-		  }
-		  else
-				written_in_total += write_to_indirect_blocks(target_fcb.single_indirect_blocks, size, buf, offset, 0);
-	}
+	uint64_t first, last;
 
+	handle_id(fi->fh, id);
+	block_range(offset, size, &first, &last);
 
-	// Calculating the size of the file
-	if (initial_offset + size > target.size)
-		target.size += (initial_offset + size) - target.size;
+	// Writes to different blocks of the file go on in parallel
+	lock_range(id, first, last, 1);
+	fetch_inode(id, &target);
 
-	// Saving the target fcb to the database
-	store_data(target.data_id, &target_fcb, sizeof(fcb));
+	int written = write_file(&target, buf, size, offset);
 
-	store_data(target.id, &target, sizeof(i_node));
+	unlock_range(id, first, last, 1);
 
-	write_log("Written in total: %d\n", written_in_total);
+	if (written < 0)
+		fuse_reply_err(req, -written);
+	else
+		fuse_reply_write(req, written);
+}
 
-	write_log("File written succesfully. \n");
+// Release callback of truncate, handing cut blocks to the reclaimer and
+// counting the data blocks
+static void release_truncated(uint64_t first, uint64_t count, int is_page, void *arg) {
+	if (!is_page)
+		*(uint64_t *) arg += count;
 
-	return written_in_total;
+	reclaim_blocks(first, count, is_page);
 }
 
-// Set the size of a file.
+// Set the size of a file, storing its inode.
 // Read 'man 2 truncate'.
-int myfs_truncate(const char *path, off_t newsize){
-    write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
+static int truncate_file(i_node *target, off_t newsize){
+    write_log("truncate_file(newsize=%lld)\n", newsize);
 
-	if(newsize >= MAX_FILE_SIZE){
+	if(newsize > MAX_FILE_SIZE){
 		write_log("myfs_truncate - EFBIG");
 		return -EFBIG;
 	}
 
-	i_node target;
-
-	findTargetInode(path, &target);
+	if (target->flags & INODE_INLINE) {
+		if (newsize <= INLINE_DATA_SIZE) {
+			if (newsize < target->size)
+				memset(target->inline_data + newsize, 0, target->size - newsize);
 
-	if (target.size >= newsize)
-		target.size = newsize;
-	else {
-		char buf[newsize - target.size];
-		memset(buf, 0, newsize - target.size);
+			target->size = newsize;
+			store_inode(target);
 
-		myfs_write(path, buf, newsize - target.size, target.size, NULL);
+			return 0;
+		}
 
-		target.size += newsize - target.size;
-	}
+		fcb target_fcb;
 
-	// Write the inode to the store.
-   	store_data(target.id, &target, sizeof(target));
+		begin_transaction();
 
-	return 0;
-}
+		uninline_file(target, &target_fcb);
+		store_map(target, &target_fcb);
 
-// Set permissions.
-// Read 'man 2 chmod'.
-int myfs_chmod(const char *path, mode_t mode){
-    write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+		target->size = newsize;
+		store_inode(target);
 
-    i_node target;
+		commit_transaction();
 
-    findTargetInode(path, &target);
+		return 0;
+	}
 
-    target.mode = mode;
+	// Growing only moves the end of the file, the new range is a hole
+	if (newsize < target->size) {
+		fcb target_fcb;
 
+		fetch_map(target, &target_fcb);
 
+		begin_transaction();
 
-    store_data(target.id, &target, sizeof(i_node));
+		// Bytes past the end of a file are kept zero, so growing it again
+		// does not bring the cut data back
+		if (newsize % BLOCK_SIZE != 0) {
+			extent tail;
 
-    return 0;
-}
+			if (extent_lookup(&target_fcb, newsize / BLOCK_SIZE, &tail)) {
+				block_key key;
+				uint8_t *block = alloc_block();
 
-// Set ownership.
-// Read 'man 2 chown'.
-int myfs_chown(const char *path, uid_t uid, gid_t gid){
-    write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+				extent_block_key(&tail, newsize / BLOCK_SIZE, &key);
 
-    i_node target;
+				int rc = fetch_block(&key, block);
 
-    findTargetInode(path, &target);
+				// Nothing has been changed yet
+				if (rc < 0) {
+					free(block);
+					commit_transaction();
+					return rc;
+				}
 
-    target.uid = uid;
-    target.gid = gid;
+				memset(block + newsize % BLOCK_SIZE, 0, BLOCK_SIZE - newsize % BLOCK_SIZE);
+				store_block(&key, block);
 
-    store_data(target.id, &target, sizeof(target));
+				free(block);
+			}
+		}
 
-    return 0;
-}
+		// The cut blocks are deleted in the background
+		uint64_t released = 0;
 
-// Create a directory
-int myfs_mkdir(const char *path, mode_t mode) {
-	write_log("\nmyfs_mkdir : %s\n",path);
+		extent_truncate(&target_fcb, (newsize + BLOCK_SIZE - 1) / BLOCK_SIZE, release_truncated, &released);
 
-	int pathlen = strlen(path);
+		store_map(target, &target_fcb);
 
-	// Returning an error if the directory path is too long
-	if (pathlen >= MAX_NAME_SIZE) {
-		write_log("\nmyfs_create - ENAMETOOLONG");
-		return -ENAMETOOLONG;
-	}
+		target->blocks -= released;
+		account_space(-(int64_t) (released * BLOCK_SIZE), released * BLOCK_SIZE);
 
-	// Find directory that is the parent directory
-	i_node parent;
+		target->size = newsize;
+		store_inode(target);
 
+		commit_transaction();
 
-	if (findTargetInode(path, &parent) != 0) {
-		write_log("myfs_mkdir: parent not found\n");
+		return 0;
 	}
 
-	char *dirname;
-	char *path_cp = strdup(path);
+	target->size = newsize;
 
-	dirname = basename(path_cp);
+	// Write the inode to the store.
+   	store_inode(target);
 
+	return 0;
+}
 
-	write_log("Base name: %s\n", dirname);
+// Change the attributes of a file. chmod, chown, truncate and utime all
+// end up here.
+static void myfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    write_log("myfs_setattr(ino=%lu, to_set=0x%x, fi=0x%08x)\n", ino, to_set, fi);
 
+    i_node target;
 
-	// Adding the new directory as an entry in the parent directory
-	dir_fcb parent_fcb;
+    if (lock_node(ino, &target, 0) != 0) {
+    	fuse_reply_err(req, ENOENT);
+    	return;
+    }
 
-	fetch_data(parent.data_id, &parent_fcb, sizeof(dir_fcb));
+    // Set the size of a file.
+    // Read 'man 2 truncate'.
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+    	int rc = S_ISDIR(target.mode) ? -EISDIR : truncate_file(&target, attr->st_size);
 
-	write_log("\nmyfs_mkdir: directory created!");
+    	if (rc != 0) {
+    		unlock_inode(target.id);
+    		fuse_reply_err(req, -rc);
+    		return;
+    	}
+    }
 
-	// Getting directory name
+    // Set permissions, keeping the type of the file.
+    // Read 'man 2 chmod'.
+    if (to_set & FUSE_SET_ATTR_MODE)
+    	target.mode = (target.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
 
-	// Finding an empty entry space
-	for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
+    // Set ownership.
+    // Read 'man 2 chown'.
+    if (to_set & FUSE_SET_ATTR_UID)
+    	target.uid = attr->st_uid;
 
-		if (strcmp("", parent_fcb.entryNames[i]) == 0) {
-			// Creating an inode for the next directory
-			i_node new_dir;
+    if (to_set & FUSE_SET_ATTR_GID)
+    	target.gid = attr->st_gid;
 
-			uuid_generate(new_dir.id);
+    // Set the access and modification times.
+    // Read 'man 2 utime'.
+    if (to_set & FUSE_SET_ATTR_ATIME)
+    	target.atime = attr->st_atime;
 
-			// Creating a dir file control block for the new directory
-			dir_fcb new_dir_entries;
+    if (to_set & FUSE_SET_ATTR_MTIME)
+    	target.mtime = attr->st_mtime;
 
-			memset(&new_dir_entries, 0, sizeof(dir_fcb));
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+    	target.atime = time(NULL);
 
-			uuid_generate(new_dir_entries.id);
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+    	target.mtime = time(NULL);
+#endif
 
-			uuid_copy(new_dir.data_id, new_dir_entries.id);
+    store_inode(&target);
 
-			store_data(new_dir.data_id, &new_dir_entries, sizeof(dir_fcb));
+    unlock_inode(target.id);
 
-			// Getting context of the current environment
-			struct fuse_context *context = fuse_get_context();
-			time_t current_time = time(NULL);
+    struct stat stbuf;
 
-			// Setting the context parameters for the new directory
-			new_dir.uid = context->uid;
-			new_dir.gid = context->gid;
-			new_dir.mode = mode | S_IFDIR;
-			new_dir.atime = current_time;
-			new_dir.ctime = current_time;
-			new_dir.mtime = current_time;
-			new_dir.size = 0;
+    fill_stat(ino, &target, &stbuf);
 
-			write_log("ID of the dir: %s", get_UUID(new_dir.id));
+    fuse_reply_attr(req, &stbuf, config.attr_timeout);
+}
 
-			// Storing the inode of the new directory in the database
-			store_data(new_dir.id, &new_dir, sizeof(i_node));
+// Create a directory
+static void myfs_mkdir(fuse_req_t req, fuse_ino_t parent_ino, const char *name, mode_t mode) {
+	write_log("\nmyfs_mkdir(parent=%lu, name=\"%s\")\n", parent_ino, name);
+
+	// Returning an error if the directory name is too long
+	if (strlen(name) >= MAX_NAME_SIZE) {
+		write_log("\nmyfs_mkdir - ENAMETOOLONG");
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
 
-			strcpy(parent_fcb.entryNames[i], dirname);
-			uuid_copy(parent_fcb.entryIds[i], new_dir.id);
-			write_log("\nmyfs_mkdir: dir entry has been found and occupied");
+	// Find directory that is the parent directory
+	i_node parent;
 
-			write_log("\nmyfs_mkdir: name of the dir:  %s : %s\n", &parent_fcb.entryNames[i], dirname);
+	if (lock_node(parent_ino, &parent, 0) != 0) {
+		write_log("myfs_mkdir: parent not found\n");
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-			parent.size++;
-			break;
-		}
+	// Creating an inode for the next directory
+	i_node new_dir;
 
-	}
+	memset(&new_dir, 0, sizeof(i_node));
 
-	store_data(parent.data_id, &parent_fcb, sizeof(dir_fcb));
+	uuid_generate(new_dir.id);
+	uuid_generate(new_dir.data_id);
 
-	store_data(parent.id, &parent, sizeof(i_node));
+	// Getting context of the current environment
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	time_t current_time = time(NULL);
 
-	write_log("\nmyfs_mkdir: directory %s created!", dirname);
+	// Setting the context parameters for the new directory
+	new_dir.uid = context->uid;
+	new_dir.gid = context->gid;
+	new_dir.mode = mode | S_IFDIR;
+	new_dir.atime = current_time;
+	new_dir.ctime = current_time;
+	new_dir.mtime = current_time;
+	new_dir.size = 0;
 
-    return 0;
-}
+	write_log("ID of the dir: %s", get_UUID(new_dir.id));
 
-// Delete a file.
-// Read 'man 2 unlink'.
-int myfs_unlink(const char *path){
-	write_log("myfs_unlink: %s\n",path);
+	begin_transaction();
 
+	// Creating the entries of the new directory and storing its inode
+	dir_init(new_dir.data_id);
+	store_inode(&new_dir);
 
-	i_node parent;
+	// Adding the new directory as an entry in the parent directory
+	int rc = dir_add(parent.data_id, name, new_dir.id, new_dir.mode);
 
-	char *parentPath;
-	char *target_name;
+	if (rc != 0) {
+		// Nothing points at the new directory, so it goes again
+		forget_inode(new_dir.id);
+		delete_record(new_dir.id, KEY_SIZE);
+		dir_release(new_dir.data_id);
 
-	char path_cp[strlen(path) + 1];
-	char path_cp2[strlen(path) + 1];
+		commit_transaction();
+		unlock_inode(parent.id);
 
-	strcpy(path_cp, path);
-	strcpy(path_cp2, path);
+		fuse_reply_err(req, -rc);
+		return;
+	}
 
-	parentPath = dirname(path_cp);
-	target_name = basename(path_cp2);
+	parent.size++;
+	parent.mtime = current_time;
 
-	write_log("Target name: %s", target_name);
+	store_inode(&parent);
 
-	findTargetInode(parentPath, &parent);
+	commit_transaction();
 
-	dir_fcb parent_fcb;
+	dentry_invalidate(parent.id, name);
 
-	fetch_data(parent.data_id, &parent_fcb, sizeof(dir_fcb));
+	unlock_inode(parent.id);
 
-	for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
-		write_log("Looping... \n");
+	write_log("\nmyfs_mkdir: directory %s created!", name);
 
-		if (strcmp(parent_fcb.entryNames[i], target_name) == 0) {
-			write_log("Found data and trying to delete: \n");
-			memset(&parent_fcb.entryNames[i], 0, sizeof(char) * MAX_NAME_SIZE);
+	reply_entry(req, &new_dir, NULL);
+}
 
-			parent.size--;
-			store_data(parent.data_id, &parent_fcb, sizeof(dir_fcb));
-			store_data(parent.id, &parent, sizeof(i_node));
-			return 0;
-		}
+// Remove the entry name from a directory. The inode it pointed at is
+// reclaimed once the kernel has forgotten it. With is_dir only an empty
+// directory is removed.
+static int remove_entry(fuse_ino_t parent_ino, const char *name, int is_dir) {
+	i_node parent;
+	i_node target;
+
+	if (lock_node(parent_ino, &parent, 0) != 0)
+		return -ENOENT;
+
+	if (lookup_child(&parent, name, &target) != 0) {
+		unlock_inode(parent.id);
+		return -ENOENT;
 	}
 
-    return -ENOENT;
-}
+	// Fetched again once it is locked, nothing can add entries to it or
+	// change its blocks from then on
+	lock_inode(target.id);
+	fetch_inode(target.id, &target);
 
-// Delete a directory.
-// Read 'man 2 rmdir'. IMPLEMENT
-int myfs_rmdir(const char *path) {
-    write_log("myfs_rmdir: %s\n",path);
+	int rc = 0;
 
+	if (is_dir && !S_ISDIR(target.mode))
+		rc = -ENOTDIR;
+	else if (is_dir && !dir_is_empty(target.data_id))
+		rc = -ENOTEMPTY;
 
-    i_node target;
+	if (rc != 0) {
+		unlock_inode(target.id);
+		unlock_inode(parent.id);
+		return rc;
+	}
 
-    findTargetInode(path, &target);
+	begin_transaction();
 
-    dir_fcb target_dir_fcb;
+	uuid_t target_id;
 
-    write_log("\nTrying to fetch \n");
+	if (dir_remove(parent.data_id, name, target_id) != 0) {
+		commit_transaction();
+		unlock_inode(target.id);
+		unlock_inode(parent.id);
+		return -ENOENT;
+	}
 
-    fetch_data(target.data_id, &target_dir_fcb, sizeof(dir_fcb));
+	parent.size--;
+	parent.mtime = time(NULL);
+	store_inode(&parent);
 
-    write_log("\nFetch succesfull\n");
+	// The records of the target are deleted in the background. Its blocks
+	// stay live until then, an open file may still write more of them.
+	node_unlink(target.id);
 
-    for (int i = 0; i < MAX_ENTRY_SIZE; i++) {
+	commit_transaction();
 
-    	if (strcmp("", target_dir_fcb.entryNames[i]) != 0) {
-    		return -ENOTEMPTY;
+	dentry_invalidate(parent.id, name);
 
-    	}
-    }
+	unlock_inode(target.id);
+	unlock_inode(parent.id);
+
+	return 0;
+}
+
+// Delete a file.
+// Read 'man 2 unlink'.
+static void myfs_unlink(fuse_req_t req, fuse_ino_t parent_ino, const char *name){
+	write_log("myfs_unlink(parent=%lu, name=\"%s\")\n", parent_ino, name);
 
+	fuse_reply_err(req, -remove_entry(parent_ino, name, 0));
+}
 
-    myfs_unlink(path);
+// Delete a directory.
+// Read 'man 2 rmdir'.
+static void myfs_rmdir(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
+    write_log("myfs_rmdir(parent=%lu, name=\"%s\")\n", parent_ino, name);
 
-    return 0;
+    fuse_reply_err(req, -remove_entry(parent_ino, name, 1));
 }
 
 // OPTIONAL - included as an example
 // Flush any cached data.
-int myfs_flush(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
+static void myfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    write_log("myfs_flush(ino=%lu, fi=0x%08x)\n", ino, fi);
 
-    write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
-
-    return retstat;
+    fuse_reply_err(req, 0);
 }
 
-// OPTIONAL - included as an example
 // Release the file. There will be one call to release for each call to open.
-int myfs_release(const char *path, struct fuse_file_info *fi){
-    int retstat = 0;
+static void myfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    write_log("myfs_release(ino=%lu, fi=0x%08x)\n", ino, fi);
+
+    // Writing back the inode once the file is closed
+    uuid_t id;
 
-    write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+    handle_id(fi->fh, id);
+    sync_inode(id);
+    handle_release(fi->fh);
 
-    return retstat;
+    fuse_reply_err(req, 0);
+}
+
+// Synchronize the file. The buffer does not tell files apart, so every
+// buffered change is written.
+// Read 'man 2 fsync'.
+static void myfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	write_log("myfs_fsync(ino=%lu, datasync=%d, fi=0x%08x)\n", ino, datasync, fi);
+
+	uuid_t id;
+
+	if (node_id(ino, id) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	flush_all();
+
+	fuse_reply_err(req, 0);
 }
 
 // OPTIONAL - included as an example
 // Open a file. Open should check if the operation is permitted for the given flags (fi->flags).
 // Read 'man 2 open'.
-static int myfs_open(const char *path, struct fuse_file_info *fi){
-	// if (strcmp(path, root_node.path) != 0)
-	// 	return -ENOENT;
+static void myfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+	write_log("myfs_open(ino=%lu, fi=0x%08x)\n", ino, fi);
 
-	write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+	i_node target;
 
-	//return -EACCES if the access is not permitted.
+	if (fetch_node(ino, &target) != 0) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	return 0;
+	//reply EACCES if the access is not permitted.
+
+	// Files only change through this mount, so the kernel's cached pages
+	// of the file are still right
+	fi->keep_cache = 1;
+	fi->fh = handle_open(target.id);
+
+	fuse_reply_open(req, fi);
+}
+
+// Start the threads of the file system once FUSE has daemonised
+static void myfs_init(void *userdata, struct fuse_conn_info *conn) {
+	write_log("myfs_init(entry_timeout=%g, attr_timeout=%g, negative_timeout=%g)\n", config.entry_timeout, config.attr_timeout, config.negative_timeout);
+
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+	// Cached pages of a file are dropped when its size or mtime is seen to
+	// change, which lets them be kept from one open to the next
+	if (conn->capable & FUSE_CAP_AUTO_INVAL_DATA)
+		conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+#endif
+
+	start_reclaimer();
+	start_flusher();
+}
+
+static void myfs_destroy(void *userdata) {
+	write_log("myfs_destroy()\n");
+
+	// Files still open at unmount are never forgotten by the kernel
+	node_release_all();
+
+	stop_reclaimer();
+	stop_flusher();
 }
 
-static struct fuse_operations myfs_oper = {
+static struct fuse_lowlevel_ops myfs_oper = {
+	.init       = myfs_init,
+	.destroy    = myfs_destroy,
+	.lookup     = myfs_lookup,
+	.forget     = myfs_forget,
 	.getattr	= myfs_getattr,
+	.setattr    = myfs_setattr,
 	.readdir	= myfs_readdir,
 	.open		= myfs_open,
 	.read		= myfs_read,
 	.create		= myfs_create,
-	.utime 		= myfs_utime,
 	.write		= myfs_write,
-	.truncate	= myfs_truncate,
 	.flush		= myfs_flush,
 	.release	= myfs_release,
+	.fsync		= myfs_fsync,
 	.mkdir 		= myfs_mkdir,
 	.rmdir      = myfs_rmdir,
 	.unlink     = myfs_unlink,
-	.chmod 		= myfs_chmod,
-	.chown      = myfs_chown,
 
 };
 
@@ -941,6 +1456,8 @@ static struct fuse_operations myfs_oper = {
 void init_fs() {
 
 	int rc;
+	i_node root_node;
+
 	printf("Initialising the file system... \n");
 
 	//Initialise the store.
@@ -949,22 +1466,12 @@ void init_fs() {
 	if (!root_is_empty) {
 		printf("%s %s %s", __func__,  ARROW, " Root directory is not empty\n");
 
-		uuid_t *data_id = &(root_object.id);
-
-		unqlite_int64 nBytes;  //Data length.
-		rc = unqlite_kv_fetch(pDb,data_id,KEY_SIZE,NULL,&nBytes);
-
-		if( rc != UNQLITE_OK ){
-		  error_handler(rc);
-		}
-
-		if(nBytes!=sizeof(i_node)){
-			printf("Data object has unexpected size. Doing nothing.\n");
-			exit(-1);
-		}
+		//Fetch the inode that the root object points at, from whichever
+		//database it is kept in
+		memset(&root_node, 0, sizeof(i_node));
+		fetch_record(root_object.id, KEY_SIZE, &root_node, INODE_HEADER_SIZE);
 
-		//Fetch the fcb that the root object points at
-		unqlite_kv_fetch(pDb,data_id,KEY_SIZE,&root_node,&nBytes);
+		uuid_copy(root_node.id, root_object.id);
 
 	} else {
 		printf("%s %s %s", __func__,  ARROW, " Root directory is empty\n");
@@ -984,30 +1491,20 @@ void init_fs() {
 
 		// Generate a key for root_node and update the root object.
 		uuid_generate(root_object.id);
+		uuid_copy(root_node.id, root_object.id);
 
 		// Initialise and store the directory fcb
 		uuid_generate(root_node.data_id);
 
-		// Make new directory fcb
-		dir_fcb entries;
-
-		memset(&entries, 0, sizeof(entries));
-
-		uuid_copy(entries.id, root_node.data_id);
-
-		// Store directory fcb in the database
+		// Store the entries of the root directory in the database
 		printf("init_fs: writing root entries fcb\n");
-		rc = unqlite_kv_store (pDb, entries.id, KEY_SIZE, &entries, sizeof(entries));
-		if( rc != UNQLITE_OK ){
-   			error_handler(rc);
-		}
-
+		dir_init(root_node.data_id);
 
 		printf("init_fs: writing root fcb\n");
-		rc = unqlite_kv_store(pDb, root_object.id, KEY_SIZE, &root_node, sizeof(i_node));
-		if( rc != UNQLITE_OK ){
-   			error_handler(rc);
-		}
+		store_record(root_object.id, KEY_SIZE, &root_node, INODE_HEADER_SIZE);
+
+		//The root object may only point at records in the store
+		flush_all();
 
 		printf("init_fs: writing updated root object\n");
 
@@ -1016,16 +1513,78 @@ void init_fs() {
 	 	if( rc != UNQLITE_OK ){
    			error_handler(rc);
 		}
+
+		commit_shards();
 	}
+
+	uuid_copy(root_id, root_node.id);
 }
 
 void shutdown_fs(){
-	unqlite_close(pDb);
+	close_store();
 }
 
+#define MYFS_OPT(t, p) { t, offsetof(struct myfs_config, p), 0 }
+
+static struct fuse_opt myfs_opts[] = {
+	MYFS_OPT("block_size=%u", block_size),
+	MYFS_OPT("shards=%u", shards),
+	MYFS_OPT("data_db=%s", data_db),
+	MYFS_OPT("flush_interval=%u", flush_interval),
+	MYFS_OPT("dirty_limit=%u", dirty_limit),
+	MYFS_OPT("entry_timeout=%lf", entry_timeout),
+	MYFS_OPT("attr_timeout=%lf", attr_timeout),
+	MYFS_OPT("negative_timeout=%lf", negative_timeout),
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[]){
-	int fuserc;
+	int fuserc = -1;
 	struct myfs_state *myfs_internal_state;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *channel;
+	struct fuse_session *session;
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+
+	config.block_size = DEFAULT_BLOCK_SIZE;
+	config.shards = DEFAULT_SHARD_COUNT;
+	config.flush_interval = DEFAULT_FLUSH_INTERVAL;
+	config.dirty_limit = DEFAULT_DIRTY_LIMIT;
+	config.entry_timeout = DEFAULT_ENTRY_TIMEOUT;
+	config.attr_timeout = DEFAULT_ATTR_TIMEOUT;
+	config.negative_timeout = DEFAULT_NEGATIVE_TIMEOUT;
+
+	if (fuse_opt_parse(&args, &config, myfs_opts, NULL) == -1)
+		return EXIT_FAILURE;
+
+	// The block size only matters when a new store gets formatted
+	if (config.block_size < MIN_BLOCK_SIZE || config.block_size > MAX_BLOCK_SIZE || (config.block_size & (config.block_size - 1)) != 0) {
+		fprintf(stderr, "myfs: block_size must be a power of two between %d and %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+		return EXIT_FAILURE;
+	}
+
+	if (config.shards < 1 || config.shards > MAX_SHARD_COUNT) {
+		fprintf(stderr, "myfs: shards must be between 1 and %d\n", MAX_SHARD_COUNT);
+		return EXIT_FAILURE;
+	}
+
+	if (config.flush_interval < 1) {
+		fprintf(stderr, "myfs: flush_interval must be at least one second\n");
+		return EXIT_FAILURE;
+	}
+
+	format_block_size = config.block_size;
+	format_shard_count = config.shards;
+	flush_interval = config.flush_interval;
+	dirty_limit = (size_t) config.dirty_limit << 20;
+
+	if (config.data_db != NULL)
+		data_database_name = config.data_db;
+
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+		return EXIT_FAILURE;
 
 	//Setup the log file and store the FILE* in the private data object for the file system.
 	myfs_internal_state = malloc(sizeof(struct myfs_state));
@@ -1034,10 +1593,35 @@ int main(int argc, char *argv[]){
 	//Initialise the file system. This is being done outside of fuse for ease of debugging.
 	init_fs();
 
-	fuserc = fuse_main(argc, argv, &myfs_oper, myfs_internal_state);
+	// The low-level API leaves mounting and the session loop to us
+	channel = fuse_mount(mountpoint, &args);
+
+	if (channel != NULL) {
+		session = fuse_lowlevel_new(&args, &myfs_oper, sizeof(myfs_oper), myfs_internal_state);
+
+		if (session != NULL) {
+			if (fuse_set_signal_handlers(session) != -1) {
+				fuse_session_add_chan(session, channel);
+				fuse_daemonize(foreground);
+
+				fuserc = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+
+				fuse_remove_signal_handlers(session);
+				fuse_session_remove_chan(channel);
+			}
+
+			fuse_session_destroy(session);
+		}
+
+		fuse_unmount(mountpoint, channel);
+	}
 
 	//Shutdown the file system.
 	shutdown_fs();
 
-	return fuserc;
+	free(mountpoint);
+	free(config.data_db);
+	fuse_opt_free_args(&args);
+
+	return fuserc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
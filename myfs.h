@@ -1,52 +1,253 @@
-#include "fs.h"
-
-#define MAX_ENTRY_SIZE 15
-#define MAX_NAME_SIZE 255
-#define MAX_BLOCK_SIZE 4
-#define MAX_BLOCK_NUMBER 12
-#define FIRST_INDIRECT_ENTRY_NUMBER 1024
-#define MAX_FILE_SIZE MAX_BLOCK_NUMBER * FIRST_INDIRECT_ENTRY_NUMBER * MAX_BLOCK_SIZE
-
-// Index node data struct, which contains meta information about the file
-typedef struct inode_struct {
-	uuid_t id; /* unique id of the current file */
-	uuid_t data_id; /* unique file data id */
-
-	uid_t  uid;		/* user */
-    gid_t  gid;		/* group */
-	mode_t mode;	/* protection */
-	time_t atime;   /* time of last access */
-	time_t mtime;	/* time of last modification */
-	time_t ctime;	/* time of last change to meta-data (status) */
-	off_t size;		/* size of the data */
-
-} i_node;
-
-// Directory file control block, which contains a key to the targeted directory and its entries
-typedef struct dir_fcb {
-	uuid_t id;
-	
-	char entryNames[MAX_ENTRY_SIZE][MAX_NAME_SIZE];
-	uuid_t entryIds[MAX_ENTRY_SIZE];
-
-} dir_fcb;
-
-
-// Data structures that describe storage of files
-typedef struct fcb {
-	uuid_t direct_blocks[MAX_BLOCK_NUMBER];
-	uuid_t single_indirect_blocks;
-
-} fcb;
-
-
-typedef struct {
-	uint8_t data[MAX_BLOCK_SIZE];
-
-} data_block;
-
-
-typedef struct {
-	uuid_t blocks[1024];
-
-} single_indirect;
+#include <stddef.h>
+
+#include "fs.h"
+
+#define DIR_PAGE_SIZE 4096
+#define MAX_NAME_SIZE 255
+#define INLINE_DATA_SIZE 1024
+#define FCB_EXTENT_NUMBER 4
+#define EXTENT_PAGE_ENTRIES 255
+#define EXTENT_MAX_DEPTH 3 /* leaf pages plus up to two levels of index pages */
+#define EXTENT_CACHE_SIZE 256
+#define DENTRY_CACHE_SIZE 1024
+#define INODE_CACHE_SIZE 4096
+#define INODE_HASH_SIZE 1024
+#define NODE_HASH_SIZE 1024
+#define OPEN_FILE_HASH_SIZE 256
+#define INODE_LOCK_HASH_SIZE 256
+#define BUFFER_HASH_SIZE 4096
+#define DEFAULT_FLUSH_INTERVAL 5 /* seconds between write-backs of the caches */
+#define DEFAULT_DIRTY_LIMIT 64 /* megabytes of buffered changes before writers wait */
+
+// Block size of the mounted file system, as recorded in its superblock
+#define BLOCK_SIZE ((off_t) super_block.block_size)
+#define BLOCK_ALIGNMENT 64
+#define MAX_FILE_SIZE ((off_t) UINT32_MAX * BLOCK_SIZE)
+
+// Index node data struct, which contains meta information about the file
+typedef struct inode_struct {
+	uuid_t id; /* unique id of the current file */
+	uuid_t data_id; /* unique file data id */
+
+	uid_t  uid;		/* user */
+    gid_t  gid;		/* group */
+	mode_t mode;	/* protection */
+	time_t atime;   /* time of last access */
+	time_t mtime;	/* time of last modification */
+	time_t ctime;	/* time of last change to meta-data (status) */
+	off_t size;		/* size of the data */
+	uint64_t blocks;	/* data blocks allocated to the file */
+	uint32_t flags;	/* INODE_* flags */
+
+	uint8_t inline_data[INLINE_DATA_SIZE]; /* data of an INODE_INLINE file */
+
+} i_node;
+
+// The data of the file lives in inline_data instead of an extent tree
+#define INODE_INLINE 0x1
+
+// Stored size of an inode without inline data
+#define INODE_HEADER_SIZE offsetof(i_node, inline_data)
+
+// Id of the inode of the root directory, set before FUSE starts. The root
+// inode itself is kept by the inode cache like any other.
+extern uuid_t root_id;
+
+// Directory file control block. The entries of the directory are kept in
+// pages numbered 0 to page_count - 1, see dir.c.
+typedef struct dir_fcb {
+	uuid_t id;
+	uint32_t page_count;
+	uint32_t free_hint; /* pages before this one have no free entry */
+
+} dir_fcb;
+
+// Directory entry, followed by the name_len bytes of its name. Of the
+// rec_len bytes up to the next entry, DIR_ENTRY_LEN(name_len) are used and
+// the rest is free space.
+typedef struct dir_entry {
+	uuid_t id;
+	uint16_t rec_len;
+	uint8_t name_len; /* 0 for a free head of a page */
+	uint8_t type; /* DT_* type of the entry */
+	char name[];
+
+} dir_entry;
+
+#define DIR_ENTRY_LEN(name_len) ((sizeof(dir_entry) + (name_len) + 3) & ~3u)
+
+// Page of directory entries, a chain of dir_entry records
+typedef struct dir_page {
+	uint8_t data[DIR_PAGE_SIZE];
+
+} dir_page;
+
+// Entry of a bucket of the name index of a directory, followed by the
+// name_len bytes of the name. Buckets are stored as a run of these.
+typedef struct dir_hash_entry {
+	uuid_t id;
+	uint32_t page; /* where the entry is kept */
+	uint16_t offset;
+	uint16_t name_len;
+
+} dir_hash_entry;
+
+// Key of a record that belongs to a directory, such as one of its pages
+typedef struct dir_key {
+	uuid_t dir; /* id of the dir_fcb */
+	uint32_t number;
+	uint8_t type; /* DIR_KEY_* */
+
+} dir_key;
+
+#define DIR_KEY_PAGE 'p'
+#define DIR_KEY_HASH 'h' /* number is the hash of the names in the bucket */
+#define DIR_KEY_SIZE sizeof(dir_key)
+
+// Data structures that describe storage of files
+
+// Blocks are keyed by their number, handed out in increasing order by the
+// allocator in the superblock. Extent pages are numbered the same way.
+typedef uint64_t block_key;
+
+#define BLOCK_KEY_SIZE sizeof(block_key)
+
+// A run of consecutive file blocks stored in consecutive block numbers.
+// In index pages the same struct points at a child page: file_block is the
+// first block the child covers and start is the number of the child page.
+typedef struct extent {
+	uint32_t file_block; /* first block of the file covered by the extent */
+	uint32_t length; /* number of blocks in the extent */
+	uint64_t start; /* number of the first block of the extent */
+
+} extent;
+
+
+// Root of the extent tree of a file. With depth 0 the entries are the
+// extents themselves, otherwise they point to pages one level down.
+typedef struct fcb {
+	uint32_t depth;
+	uint32_t count;
+	extent entries[FCB_EXTENT_NUMBER];
+
+} fcb;
+
+
+// Node of the extent tree stored outside the fcb
+typedef struct extent_page {
+	uint32_t level; /* 0 for leaves, otherwise height above the leaves */
+	uint32_t count;
+	extent entries[EXTENT_PAGE_ENTRIES];
+
+} extent_page;
+
+
+void fetch_data(uuid_t data_id, void* dataStorage, size_t size);
+void store_data(uuid_t data_id, void* data, size_t size);
+void load_inode(uuid_t id, i_node *node);
+void save_inode(const i_node *node);
+void fetch_record(const void *key, int key_size, void *data, size_t size);
+void *fetch_record_alloc(const void *key, int key_size, size_t *size);
+void store_record(const void *key, int key_size, const void *data, size_t size);
+void delete_record(const void *key, int key_size);
+int fetch_block(const block_key *key, void *data);
+void store_block(const block_key *key, const void *data);
+void delete_block(const block_key *key);
+
+// Cache of inodes with write-back of changed ones (inode.c)
+void fetch_inode(uuid_t id, i_node *node);
+void store_inode(i_node *node);
+void sync_inode(uuid_t id);
+void write_back_inodes();
+void forget_inode(uuid_t id);
+void pin_inode(uuid_t id);
+void unpin_inode(uuid_t id);
+
+// Buffer of changes not written yet (buffer.c)
+#define BUFFER_METADATA 0
+#define BUFFER_DATA 1 /* data blocks, kept in the databases of the data */
+
+int buffer_fetch(int set, const void *key, int key_size, void *data, size_t *size);
+int buffer_fetch_alloc(int set, const void *key, int key_size, void **data, size_t *size);
+void buffer_store(int set, const void *key, int key_size, const void *data, size_t size);
+void buffer_delete(int set, const void *key, int key_size);
+int buffer_take();
+void buffer_write();
+void throttle_buffer();
+
+// Write-back of buffered changes by the flusher thread (flush.c)
+extern unsigned int flush_interval;
+extern size_t dirty_limit; /* bytes */
+
+void flush_all();
+void wake_flusher();
+void start_flusher();
+void stop_flusher();
+
+// Locks of inodes for concurrent operations (lock.c)
+void lock_inode(const uuid_t id);
+void lock_inode_shared(const uuid_t id);
+void unlock_inode(const uuid_t id);
+void lock_range(const uuid_t id, uint64_t first, uint64_t last, int write);
+void unlock_range(const uuid_t id, uint64_t first, uint64_t last, int write);
+void lock_map(const uuid_t id);
+void unlock_map(const uuid_t id);
+
+// Inode numbers known to the kernel (node.c)
+#define ROOT_INODE_NUMBER 1 /* FUSE_ROOT_ID */
+
+uint64_t node_get(const uuid_t id);
+int node_id(uint64_t ino, uuid_t id);
+uint64_t node_peek(const uuid_t id);
+void node_forget(uint64_t ino, uint64_t nlookup);
+void node_unlink(const uuid_t id);
+void node_release_all();
+
+// Files held open by the kernel (handle.c)
+uint64_t handle_open(uuid_t id);
+void handle_release(uint64_t fh);
+void handle_id(uint64_t fh, uuid_t id);
+void fetch_map(const i_node *node, fcb *map);
+void store_map(const i_node *node, fcb *map);
+
+// Deferred deletion of unlinked files and truncated blocks (reclaim.c)
+#define RECLAIM_KEY "reclaim"
+#define RECLAIM_KEY_SIZE 7
+#define RECLAIM_RECORD_KEY_SIZE (RECLAIM_KEY_SIZE + sizeof(uint64_t)) /* followed by the number */
+
+uint64_t record_reclaim_inode(const uuid_t id);
+void queue_reclaim(uint64_t number);
+void reclaim_blocks(uint64_t first, uint64_t count, int is_page);
+void start_reclaimer();
+void stop_reclaimer();
+
+// Extent tree of a file (extent.c)
+int extent_lookup(fcb *map, uint32_t file_block, extent *found);
+int extent_map_blocks(fcb *map, uint32_t file_block, uint32_t count, extent *mapped);
+void extent_block_key(const extent *e, uint32_t file_block, block_key *key);
+// Called with every run of block numbers an extent tree lets go of;
+// is_page tells extent pages apart from data blocks
+typedef void (*extent_release_fn)(uint64_t first, uint64_t count, int is_page, void *arg);
+
+void extent_truncate(fcb *map, uint32_t first_block, extent_release_fn release, void *arg);
+void extent_release_all(fcb *map, extent_release_fn release, void *arg);
+
+#define EXTENT_NONE ((uint64_t) UINT32_MAX + 1)
+
+// Entries of a directory (dir.c)
+// Called with every entry of a directory and its position, a non-zero
+// result stops the walk
+typedef int (*dir_fill_fn)(const char *name, uuid_t id, uint8_t type, uint64_t position, void *arg);
+
+void dir_init(uuid_t data_id);
+int dir_lookup(uuid_t dir_id, const char *name, uuid_t id);
+int dir_add(uuid_t dir_id, const char *name, uuid_t id, mode_t mode);
+int dir_remove(uuid_t dir_id, const char *name, uuid_t id);
+void dir_iterate(uuid_t dir_id, uint64_t from, dir_fill_fn fill, void *arg);
+int dir_is_empty(uuid_t dir_id);
+void dir_release(uuid_t data_id);
+
+// Cache of resolved names (dentry.c)
+int dentry_lookup(const uuid_t parent, const char *name, uuid_t id);
+void dentry_insert(const uuid_t parent, const char *name, const uuid_t id);
+void dentry_invalidate(const uuid_t parent, const char *name);
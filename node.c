@@ -0,0 +1,203 @@
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Inode numbers handed to the kernel. Inodes are identified by their uuid
+// in the store, the kernel knows them by a number given out the first time
+// it looks them up. A number stays valid until the kernel has forgotten
+// every lookup of it, so an inode that is unlinked while the kernel still
+// knows it is only reclaimed once it is forgotten.
+typedef struct fs_node {
+	uint64_t ino;
+	uuid_t id;
+	uint64_t nlookup;
+	uint64_t reclaim; /* once unlinked, the number of its reclaim record */
+
+	struct fs_node *ino_next;
+	struct fs_node *id_next;
+
+} fs_node;
+
+static fs_node *by_ino[NODE_HASH_SIZE];
+static fs_node *by_id[NODE_HASH_SIZE];
+static uint64_t next_ino = ROOT_INODE_NUMBER + 1;
+
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static fs_node **ino_slot(uint64_t ino) {
+	return &by_ino[ino % NODE_HASH_SIZE];
+}
+
+static fs_node **id_slot(const uuid_t id) {
+	return &by_id[uuid_hash(id) % NODE_HASH_SIZE];
+}
+
+static fs_node *find_ino(uint64_t ino) {
+	fs_node *node = *ino_slot(ino);
+
+	while (node != NULL && node->ino != ino)
+		node = node->ino_next;
+
+	return node;
+}
+
+static fs_node *find_id(const uuid_t id) {
+	fs_node *node = *id_slot(id);
+
+	while (node != NULL && uuid_compare(node->id, id) != 0)
+		node = node->id_next;
+
+	return node;
+}
+
+static void remove_node(fs_node *node) {
+	fs_node **link = ino_slot(node->ino);
+
+	while (*link != node)
+		link = &(*link)->ino_next;
+
+	*link = node->ino_next;
+
+	link = id_slot(node->id);
+
+	while (*link != node)
+		link = &(*link)->id_next;
+
+	*link = node->id_next;
+
+	free(node);
+}
+
+// Inode number of an inode that is being handed to the kernel in a lookup
+uint64_t node_get(const uuid_t id) {
+	if (uuid_compare(id, root_id) == 0)
+		return ROOT_INODE_NUMBER;
+
+	pthread_mutex_lock(&node_lock);
+
+	fs_node *node = find_id(id);
+
+	if (node == NULL) {
+		node = calloc(1, sizeof(fs_node));
+		node->ino = next_ino++;
+		uuid_copy(node->id, id);
+
+		node->ino_next = *ino_slot(node->ino);
+		*ino_slot(node->ino) = node;
+		node->id_next = *id_slot(id);
+		*id_slot(id) = node;
+	}
+
+	node->nlookup++;
+	uint64_t ino = node->ino;
+
+	pthread_mutex_unlock(&node_lock);
+
+	return ino;
+}
+
+// Inode id behind an inode number. Returns 0, or -1 if the number is not
+// known.
+int node_id(uint64_t ino, uuid_t id) {
+	if (ino == ROOT_INODE_NUMBER) {
+		uuid_copy(id, root_id);
+		return 0;
+	}
+
+	pthread_mutex_lock(&node_lock);
+
+	fs_node *node = find_ino(ino);
+
+	if (node != NULL)
+		uuid_copy(id, node->id);
+
+	pthread_mutex_unlock(&node_lock);
+
+	return node != NULL ? 0 : -1;
+}
+
+// Inode number the kernel already has for an inode, without taking a
+// reference, or 0
+uint64_t node_peek(const uuid_t id) {
+	if (uuid_compare(id, root_id) == 0)
+		return ROOT_INODE_NUMBER;
+
+	pthread_mutex_lock(&node_lock);
+
+	fs_node *node = find_id(id);
+	uint64_t ino = node != NULL ? node->ino : 0;
+
+	pthread_mutex_unlock(&node_lock);
+
+	return ino;
+}
+
+// The kernel dropped nlookup lookups of an inode number
+void node_forget(uint64_t ino, uint64_t nlookup) {
+	if (ino == ROOT_INODE_NUMBER)
+		return;
+
+	pthread_mutex_lock(&node_lock);
+
+	fs_node *node = find_ino(ino);
+
+	if (node == NULL) {
+		pthread_mutex_unlock(&node_lock);
+		return;
+	}
+
+	node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+
+	if (node->nlookup > 0) {
+		pthread_mutex_unlock(&node_lock);
+		return;
+	}
+
+	uint64_t reclaim = node->reclaim;
+
+	remove_node(node);
+
+	pthread_mutex_unlock(&node_lock);
+
+	if (reclaim != 0)
+		queue_reclaim(reclaim);
+}
+
+// The last name of an inode was removed. It is reclaimed now if the
+// kernel does not know it, otherwise once the kernel forgets it. Either
+// way the reclaiming is kept in the store from now on, so it is called in
+// the transaction removing the name.
+void node_unlink(const uuid_t id) {
+	uint64_t reclaim = record_reclaim_inode(id);
+
+	pthread_mutex_lock(&node_lock);
+
+	fs_node *node = find_id(id);
+
+	if (node != NULL)
+		node->reclaim = reclaim;
+
+	pthread_mutex_unlock(&node_lock);
+
+	if (node == NULL)
+		queue_reclaim(reclaim);
+}
+
+// Reclaim unlinked inodes the kernel did not forget before unmounting
+void node_release_all() {
+	pthread_mutex_lock(&node_lock);
+
+	for (int i = 0; i < NODE_HASH_SIZE; i++) {
+		while (by_ino[i] != NULL) {
+			fs_node *node = by_ino[i];
+
+			if (node->reclaim != 0)
+				queue_reclaim(node->reclaim);
+
+			remove_node(node);
+		}
+	}
+
+	pthread_mutex_unlock(&node_lock);
+}
@@ -0,0 +1,284 @@
+#include <pthread.h>
+
+#include "myfs.h"
+
+// Records that are no longer referenced and wait to be deleted. Unlink and
+// truncate only queue them, the reclaimer thread does the deleting.
+//
+// Each piece of work is also kept in the store, numbered in the order it
+// was queued, and deleted in the same transaction as the records it
+// reclaims. Work still pending when the file system goes down is queued
+// again at the next mount, so the space it holds is not lost. The numbers
+// in use lie between first and next, which are kept in a record of their
+// own.
+typedef struct reclaim_record {
+	uuid_t id;
+	uint8_t is_inode; /* a whole file or directory, otherwise a run of blocks */
+	uint8_t is_page;
+	uint8_t padding[6];
+	uint64_t first;
+	uint64_t count;
+
+} reclaim_record;
+
+typedef struct reclaim_state {
+	uint64_t first; /* no record numbered below is left */
+	uint64_t next;
+
+} reclaim_state;
+
+typedef struct reclaim_item {
+	uint64_t number;
+	reclaim_record record;
+
+	struct reclaim_item *next;
+
+} reclaim_item;
+
+static reclaim_item *queue_head;
+static reclaim_item *queue_tail;
+static int stopping;
+static reclaim_state state = { 1, 1 };
+
+static pthread_t reclaimer;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+
+static void record_key(uint64_t number, uint8_t *key) {
+	memcpy(key, RECLAIM_KEY, RECLAIM_KEY_SIZE);
+	memcpy(key + RECLAIM_KEY_SIZE, &number, sizeof(number));
+}
+
+static void enqueue(uint64_t number, const reclaim_record *record) {
+	reclaim_item *item = malloc(sizeof(reclaim_item));
+
+	item->number = number;
+	memcpy(&item->record, record, sizeof(reclaim_record));
+	item->next = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+
+	if (queue_tail == NULL)
+		queue_head = item;
+	else
+		queue_tail->next = item;
+
+	queue_tail = item;
+
+	pthread_cond_signal(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// Keep a piece of work in the store and return its number
+static uint64_t add_record(const reclaim_record *record) {
+	uint8_t key[RECLAIM_RECORD_KEY_SIZE];
+
+	begin_transaction();
+	pthread_mutex_lock(&queue_lock);
+
+	uint64_t number = state.next++;
+
+	record_key(number, key);
+	store_record(key, RECLAIM_RECORD_KEY_SIZE, record, sizeof(reclaim_record));
+	store_record(RECLAIM_KEY, RECLAIM_KEY_SIZE, &state, sizeof(reclaim_state));
+
+	pthread_mutex_unlock(&queue_lock);
+	commit_transaction();
+
+	return number;
+}
+
+// Delete the record of finished work, moving first past every number whose
+// work is done. The caller holds a transaction.
+static void remove_record(uint64_t number) {
+	uint8_t key[RECLAIM_RECORD_KEY_SIZE];
+	size_t size;
+
+	record_key(number, key);
+	delete_record(key, RECLAIM_RECORD_KEY_SIZE);
+
+	pthread_mutex_lock(&queue_lock);
+
+	while (state.first < state.next) {
+		record_key(state.first, key);
+
+		void *left = fetch_record_alloc(key, RECLAIM_RECORD_KEY_SIZE, &size);
+
+		if (left != NULL) {
+			free(left);
+			break;
+		}
+
+		state.first++;
+	}
+
+	store_record(RECLAIM_KEY, RECLAIM_KEY_SIZE, &state, sizeof(reclaim_state));
+
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// Keep the reclaiming of an unlinked inode, together with everything it
+// owns, in the store. Returns the number queue_reclaim takes to queue it,
+// which waits while the kernel still knows the inode.
+uint64_t record_reclaim_inode(const uuid_t id) {
+	reclaim_record record;
+
+	memset(&record, 0, sizeof(reclaim_record));
+	record.is_inode = 1;
+	uuid_copy(record.id, id);
+
+	return add_record(&record);
+}
+
+// Queue work kept in the store by record_reclaim_inode
+void queue_reclaim(uint64_t number) {
+	uint8_t key[RECLAIM_RECORD_KEY_SIZE];
+	reclaim_record record;
+
+	record_key(number, key);
+	fetch_record(key, RECLAIM_RECORD_KEY_SIZE, &record, sizeof(reclaim_record));
+
+	enqueue(number, &record);
+}
+
+// Queue a run of blocks, or an extent page, a file let go of
+void reclaim_blocks(uint64_t first, uint64_t count, int is_page) {
+	reclaim_record record;
+
+	memset(&record, 0, sizeof(reclaim_record));
+	record.first = first;
+	record.count = count;
+	record.is_page = is_page;
+
+	enqueue(add_record(&record), &record);
+}
+
+// Release callback deleting blocks right away, adding up the data bytes
+static void delete_blocks(uint64_t first, uint64_t count, int is_page, void *arg) {
+	for (uint64_t block = first; block < first + count; block++) {
+		if (is_page)
+			delete_record(&block, BLOCK_KEY_SIZE);
+		else
+			delete_block(&block);
+	}
+
+	if (!is_page)
+		*(uint64_t *) arg += count * BLOCK_SIZE;
+}
+
+static void reclaim_item_now(reclaim_item *item) {
+	reclaim_record *record = &item->record;
+	uint64_t freed = 0;
+
+	begin_transaction();
+
+	if (record->is_inode) {
+		i_node node;
+
+		fetch_inode(record->id, &node);
+
+		if (S_ISDIR(node.mode))
+			dir_release(node.data_id);
+		else if (!(node.flags & INODE_INLINE)) {
+			fcb map;
+
+			fetch_data(node.data_id, &map, sizeof(fcb));
+			extent_release_all(&map, delete_blocks, &freed);
+			delete_record(node.data_id, KEY_SIZE);
+		}
+
+		forget_inode(record->id);
+		delete_record(record->id, KEY_SIZE);
+	}
+	else
+		delete_blocks(record->first, record->count, record->is_page, &freed);
+
+	// Truncated blocks were moved to the dead bytes when they were cut, the
+	// blocks of an inode are live up to now
+	if (record->is_inode)
+		account_space(-(int64_t) freed, 0);
+	else
+		account_space(0, -(int64_t) freed);
+
+	remove_record(item->number);
+
+	commit_transaction();
+}
+
+static void *reclaim_loop(void *arg) {
+	pthread_mutex_lock(&queue_lock);
+
+	for (;;) {
+		while (queue_head == NULL && !stopping)
+			pthread_cond_wait(&queue_ready, &queue_lock);
+
+		if (queue_head == NULL)
+			break;
+
+		reclaim_item *item = queue_head;
+
+		queue_head = item->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+
+		pthread_mutex_unlock(&queue_lock);
+
+		reclaim_item_now(item);
+		free(item);
+
+		pthread_mutex_lock(&queue_lock);
+	}
+
+	pthread_mutex_unlock(&queue_lock);
+
+	return NULL;
+}
+
+// Started from the FUSE init callback, since fuse_main forks before that.
+// Work left over from the last mount is queued first; inodes it unlinked
+// are no longer known to any kernel.
+void start_reclaimer() {
+	reclaim_state *stored;
+	size_t size;
+
+	stored = fetch_record_alloc(RECLAIM_KEY, RECLAIM_KEY_SIZE, &size);
+
+	if (stored != NULL) {
+		memcpy(&state, stored, sizeof(reclaim_state));
+		free(stored);
+	}
+
+	for (uint64_t number = state.first; number < state.next; number++) {
+		uint8_t key[RECLAIM_RECORD_KEY_SIZE];
+		reclaim_record *record;
+
+		record_key(number, key);
+		record = fetch_record_alloc(key, RECLAIM_RECORD_KEY_SIZE, &size);
+
+		if (record != NULL) {
+			enqueue(number, record);
+			free(record);
+		}
+	}
+
+	if (state.next > state.first)
+		write_log("Reclaiming records left over from the last mount\n");
+
+	stopping = 0;
+
+	if (pthread_create(&reclaimer, NULL, reclaim_loop, NULL) != 0) {
+		write_log("myfs - cannot start the reclaimer thread\n");
+		exit(-1);
+	}
+}
+
+// Delete whatever is still queued and stop the thread
+void stop_reclaimer() {
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_signal(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+
+	pthread_join(reclaimer, NULL);
+}